@@ -1,21 +1,92 @@
 #include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <deque>
 #include <fstream>
+#include <functional>
 #include <future>
 #include <iostream>
+#include <limits>
 #include <list>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <sstream>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#include <fcntl.h>
+#include <glob.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
 #include "date.h"
 
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "Binary checkpoints are read in place and assume a little-endian host"
+#endif
+
 namespace {
 const int kDepShift = 100;
 const int kThreads = 8;
 const int kCleanEvery = 50000;
 const int kDumpEvery = 200000;
+const int kTaskPairs = 1 << 16;
+const size_t kSharedTableInitialCapacity = 1 << 24;
+const size_t kOutboxSize = 4096;
+// Rough heap cost of SparseMatrix rows/entries, for progress reports and
+// load-time memory checks.
+const size_t kRowBytes = 96;
+const size_t kEntryBytes = 40;
+const size_t kWriteBufferSize = 1 << 20;
 int kSaveThreshold = 50;
+int kProgressEverySeconds = 10;
+std::string kProgressJsonPath;
+bool kBackgroundCheckpoints = true;
+// Every Nth dump is a full checkpoint, the others are deltas. Deltas need
+// the binary format; 1 turns them off.
+int kFullCheckpointEvery = 4;
+// Binary checkpoints are split into this many row shards when above 1.
+int kCheckpointShards = 1;
+// Refuse to load checkpoints that will not fit into available memory.
+bool kCheckMemory = true;
+int kWorkerThreads = kThreads;
+// Index rows keep only their best entries: Predict() reads at most
+// kDepShift + 1 unseen ones per track. 0 keeps whole rows.
+size_t kIndexTopK = 4 * kDepShift;
+// Predict from this prebuilt index file instead of indexing r_data_big;
+// a training run rewrites it from the model it trained.
+std::string kIndexPath;
+// Serializes whole log lines, see LogLine.
+std::mutex kLogMutex;
+// Width of index scores: 32 keeps them exact, 16 and 8 quantize them
+// against a per-row scale for a denser index.
+int kIndexScoreBits = 32;
+
+enum class TrainMode {
+  kLocal,  // one thread, one SparseMatrix
+  kShared, // kWorkerThreads threads, one ConcurrentPairTable
+  kRouted, // kWorkerThreads threads, each owning a row partition
+};
+TrainMode kTrainMode = TrainMode::kLocal;
+
+enum class CheckpointFormat {
+  kText,   // Save()/Load(), kept for export and old checkpoints
+  kBinary, // BinaryCheckpointWriter/BinaryCheckpointReader
+  kPacked, // kBinary with kCheckpointGroupVarint rows
+};
+CheckpointFormat kCheckpointFormat = CheckpointFormat::kPacked;
 } // namespace
 
 using namespace date;
@@ -32,245 +103,3065 @@ struct ScoredTrackId {
   int score;
 };
 
-using DataIndex = std::unordered_map<IdT, std::vector<ScoredTrackId>>;
 struct User {
   IdT id;
   std::vector<IdT> tracks{};
 };
 
-struct Prediction {
-  IdT user_id;
-  std::vector<IdT> prediction;
+struct Prediction {
+  IdT user_id;
+  std::vector<IdT> prediction;
+};
+
+/**
+ * One line of the log, written to std::cout in one piece when it goes out
+ * of scope. Lines come from several threads at once; formatting each into
+ * its own stream keeps them whole and keeps the threads off std::cout's
+ * shared format state.
+ */
+class LogLine {
+public:
+  LogLine() = default;
+  LogLine(const LogLine &) = delete;
+  LogLine &operator=(const LogLine &) = delete;
+
+  ~LogLine() {
+    os_ << '\n';
+    std::lock_guard<std::mutex> lock(kLogMutex);
+    std::cout << os_.str() << std::flush;
+  }
+
+  template <typename T> LogLine &operator<<(const T &value) {
+    os_ << value;
+    return *this;
+  }
+
+private:
+  std::ostringstream os_;
+};
+
+size_t CalcSize(const SparseMatrix &matrix) {
+  size_t deps_c = 0;
+  for (const auto &it : matrix) {
+    deps_c += it.second.size();
+  }
+  return deps_c;
+}
+
+int Reduce(SparseMatrix &matrix, int threshold,
+           std::unordered_set<IdT> *touched = nullptr) {
+  int removed = 0;
+  auto it = matrix.begin();
+  while (it != matrix.end()) {
+    auto jt = it->second.begin();
+    while (jt != it->second.end()) {
+      if (jt->second < threshold) {
+        removed++;
+        if (touched)
+          touched->insert(it->first);
+        jt = it->second.erase(jt);
+      } else {
+        jt++;
+      }
+    }
+    if (it->second.empty()) {
+      it = matrix.erase(it);
+    } else {
+      it++;
+    }
+  }
+  return removed;
+}
+
+/**
+ * Buffered text output for multi-GB dumps: whole buffers go to write(2),
+ * and integers are formatted by hand, two digits at a time.
+ */
+class TextWriter {
+public:
+  explicit TextWriter(const std::string &filename)
+      : filename_(filename), buffer_(new char[kWriteBufferSize]),
+        fd_(open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)) {
+    if (fd_ < 0)
+      throw std::runtime_error("Can't write " + filename_);
+  }
+  TextWriter(const TextWriter &) = delete;
+  TextWriter &operator=(const TextWriter &) = delete;
+  ~TextWriter() {
+    if (fd_ >= 0)
+      close(fd_);
+  }
+
+  TextWriter &operator<<(char c) {
+    Reserve(1);
+    buffer_[pos_++] = c;
+    return *this;
+  }
+  TextWriter &operator<<(const char *str) {
+    Write(str, std::strlen(str));
+    return *this;
+  }
+  template <typename T, typename = typename std::enable_if<
+                            std::is_integral<T>::value>::type>
+  TextWriter &operator<<(T value) {
+    // Widest is a sign and 20 digits of a uint64_t.
+    Reserve(21);
+    uint64_t abs = static_cast<uint64_t>(value);
+    if (value < 0) {
+      buffer_[pos_++] = '-';
+      abs = 0 - abs;
+    }
+    char digits[20];
+    char *end = digits + sizeof(digits);
+    char *begin = end;
+    for (; abs >= 100; abs /= 100) {
+      begin -= 2;
+      std::memcpy(begin, kDigitPairs + 2 * (abs % 100), 2);
+    }
+    if (abs >= 10) {
+      begin -= 2;
+      std::memcpy(begin, kDigitPairs + 2 * abs, 2);
+    } else {
+      *--begin = static_cast<char>('0' + abs);
+    }
+    std::memcpy(buffer_.get() + pos_, begin, end - begin);
+    pos_ += end - begin;
+    return *this;
+  }
+
+  void Write(const char *data, size_t size) {
+    while (size) {
+      Reserve(std::min(size, kWriteBufferSize));
+      const size_t chunk = std::min(size, kWriteBufferSize - pos_);
+      std::memcpy(buffer_.get() + pos_, data, chunk);
+      pos_ += chunk;
+      data += chunk;
+      size -= chunk;
+    }
+  }
+
+  void Finish() {
+    Flush();
+    const int fd = fd_;
+    fd_ = -1;
+    if (close(fd) != 0)
+      throw std::runtime_error("Failed to write " + filename_);
+  }
+
+private:
+  static constexpr const char *kDigitPairs =
+      "00010203040506070809101112131415161718192021222324252627282930313233"
+      "34353637383940414243444546474849505152535455565758596061626364656667"
+      "6869707172737475767778798081828384858687888990919293949596979899";
+
+  void Reserve(size_t size) {
+    if (kWriteBufferSize - pos_ < size)
+      Flush();
+  }
+
+  void Flush() {
+    for (size_t done = 0; done < pos_;) {
+      const ssize_t res = write(fd_, buffer_.get() + done, pos_ - done);
+      if (res < 0 && errno == EINTR)
+        continue;
+      if (res <= 0)
+        throw std::runtime_error("Failed to write " + filename_ + ": " +
+                                 std::strerror(errno));
+      done += res;
+    }
+    pos_ = 0;
+  }
+
+  const std::string filename_;
+  std::unique_ptr<char[]> buffer_;
+  size_t pos_ = 0;
+  int fd_;
+};
+
+/**
+ * Data format:
+ * <tracks_cnt>
+ * <track_id> <deps_cnt> <popularity>
+ * <depended_track_id> <weight>
+ * ...
+ * <depended_track_id> <weight>
+ * ...
+ */
+void Save(const std::vector<const SparseMatrix *> &parts,
+          const std::string &filename) {
+  static const char kSep = ' ';
+  TextWriter os(filename);
+  size_t tracks_cnt = 0;
+  for (const auto *part : parts) {
+    tracks_cnt += part->size();
+  }
+  os << tracks_cnt << '\n';
+  for (const auto *part : parts) {
+    for (auto it = part->begin(); it != part->end(); it++) {
+      // Suppose, popularity is useless
+      os << it->first << kSep << it->second.size() << kSep << /*popularity=*/0
+         << '\n';
+      for (const auto jt : it->second) {
+        os << jt.first << kSep << jt.second << '\n';
+      }
+    }
+  }
+  os.Finish();
+}
+
+void Save(const Data &data, const std::string &filename) {
+  Save(std::vector<const SparseMatrix *>{&data.deps}, filename);
+}
+
+// Runs worker(0) ... worker(threads - 1) concurrently and waits for all.
+template <typename F> void RunWorkers(int threads, F worker) {
+  std::vector<std::future<void>> futures;
+  for (int t = 0; t < threads; t++) {
+    futures.push_back(std::async(std::launch::async, worker, t));
+  }
+  for (auto &fut : futures) {
+    fut.get();
+  }
+}
+
+/**
+ * CRC32C (Castagnoli), with the SSE4.2 crc32 instruction where the CPU has
+ * it and a table otherwise. Start with crc = 0 and chain calls to
+ * checksum data in pieces.
+ */
+uint32_t Crc32cSoftware(uint32_t crc, const char *data, size_t size) {
+  static const auto kTable = [] {
+    std::vector<uint32_t> table(256);
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t value = i;
+      for (int bit = 0; bit < 8; bit++) {
+        value = (value >> 1) ^ (value & 1 ? 0x82f63b78 : 0);
+      }
+      table[i] = value;
+    }
+    return table;
+  }();
+  crc = ~crc;
+  for (size_t i = 0; i < size; i++) {
+    crc = kTable[(crc ^ static_cast<uint8_t>(data[i])) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) uint32_t
+Crc32cHardware(uint32_t crc, const char *data, size_t size) {
+  uint64_t value = ~crc & 0xffffffffu;
+  for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t)) {
+    uint64_t word;
+    std::memcpy(&word, data, sizeof(word));
+    value = __builtin_ia32_crc32di(value, word);
+    data += sizeof(word);
+  }
+  uint32_t res = static_cast<uint32_t>(value);
+  for (; size; size--) {
+    res = __builtin_ia32_crc32qi(res, static_cast<uint8_t>(*data++));
+  }
+  return ~res;
+}
+#endif
+
+uint32_t Crc32c(uint32_t crc, const char *data, size_t size) {
+#if defined(__x86_64__)
+  static const bool kHardware = __builtin_cpu_supports("sse4.2");
+  if (kHardware)
+    return Crc32cHardware(crc, data, size);
+#endif
+  return Crc32cSoftware(crc, data, size);
+}
+
+// Bytes the kernel can still give us, or 0 if unknown.
+uint64_t AvailableMemory() {
+  std::ifstream is("/proc/meminfo");
+  std::string key;
+  uint64_t kilobytes;
+  std::string unit;
+  while (is >> key >> kilobytes >> unit) {
+    if (key == "MemAvailable:")
+      return kilobytes * 1024;
+  }
+  return 0;
+}
+
+/**
+ * Refuses to load |what| if its expected in-memory size exceeds the
+ * available memory: failing here beats getting OOM-killed midway.
+ */
+void CheckMemory(uint64_t bytes, const std::string &what) {
+  if (!kCheckMemory)
+    return;
+  const uint64_t available = AvailableMemory();
+  if (available && bytes > available)
+    throw std::runtime_error(
+        "Loading " + what + " needs ~" + std::to_string(bytes >> 20) +
+        " MiB, only " + std::to_string(available >> 20) +
+        " MiB available (--ignore-memory-check to try anyway)");
+}
+
+/**
+ * Binary checkpoint format, little-endian:
+ * CheckpointHeader
+ * <track_id:u32> <deps_cnt:u32> <depended_track_id:u32> x deps_cnt
+ *                               <weight:i32> x deps_cnt
+ * ...
+ * Rows are sorted by track_id and each row by depended_track_id, so the
+ * file can be read in place from a mapping and merged as sorted runs.
+ * header_size lets readers skip header fields added by newer versions.
+ *
+ * A delta checkpoint (kCheckpointDelta) holds only the rows changed since
+ * the dump sequence - 1, each with its full new content; a row with
+ * deps_cnt 0 was deleted. Delta <base>.delta.<N> applies on top of the
+ * state at dump N - 1, see LoadCheckpointChain().
+ *
+ * With kCheckpointGroupVarint (since version 4) a row is instead
+ * <track_id - previous track_id:varint> <deps_cnt:varint>
+ * <depended_track_id - previous depended_track_id:group varint> x deps_cnt
+ * <weight:group varint> x deps_cnt
+ * Group varint packs 4 values behind a tag byte holding their byte lengths
+ * minus one, 2 bits each, low bits first; the last group of a row may be
+ * short. Such rows are decoded into buffers instead of read in place.
+ *
+ * Since version 5 the header is self-validating: header_crc covers the
+ * header (with header_crc itself zeroed) and data_crc the data_bytes of
+ * rows after it, so a file cut short by a crash or flipped on disk is
+ * rejected before use. memory_bytes estimates the loaded SparseMatrix.
+ */
+const char kCheckpointMagic[4] = {'M', 'R', 'C', 'K'};
+const uint32_t kCheckpointVersion = 5;
+const uint32_t kCheckpointHeaderV1Size = 32;
+const uint32_t kCheckpointDelta = 1;
+const uint32_t kCheckpointGroupVarint = 2;
+const int kTrainInputs = 3;
+
+// Where training stood when a checkpoint was taken.
+struct TrainPosition {
+  // Index of the first uncounted user in the concatenated train inputs.
+  uint64_t next_user;
+  // Users counted so far; the clean/dump cadence follows it.
+  uint64_t counted;
+  // Lines in each train input, so that a resume can skip the consumed
+  // prefix without parsing it.
+  uint64_t input_users[kTrainInputs];
+};
+
+// Everything a checkpoint records besides the matrix itself.
+struct CheckpointMeta {
+  uint64_t sequence;
+  TrainPosition position;
+};
+
+struct CheckpointHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t header_size;
+  uint32_t flags;
+  uint64_t rows;
+  uint64_t entries;
+  // Since version 2 (sequence) and 3 (position).
+  CheckpointMeta meta;
+  // Since version 5.
+  uint64_t data_bytes;
+  uint64_t memory_bytes;
+  uint32_t data_crc;
+  uint32_t header_crc;
+};
+
+// One row of a checkpoint; the arrays stay valid until the next row is read.
+struct CheckpointRow {
+  IdT id;
+  uint32_t size;
+  const IdT *ids;
+  const int *weights;
+};
+
+// Where a checkpoint reader stands between two rows; see Tell()/Seek().
+struct CheckpointPosition {
+  uint64_t offset;
+  uint64_t rows;
+  IdT prev_id;
+};
+
+class MappedFile {
+public:
+  explicit MappedFile(const std::string &filename,
+                      int advice = MADV_SEQUENTIAL) {
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error("Can't open " + filename);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      throw std::runtime_error("Can't stat " + filename);
+    }
+    size_ = static_cast<size_t>(st.st_size);
+    if (size_) {
+      void *addr = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+      if (addr == MAP_FAILED) {
+        close(fd);
+        throw std::runtime_error("Can't map " + filename);
+      }
+      data_ = static_cast<const char *>(addr);
+      madvise(addr, size_, advice);
+    }
+    close(fd);
+  }
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+  ~MappedFile() {
+    if (data_)
+      munmap(const_cast<char *>(data_), size_);
+  }
+
+  const char *data() const { return data_; }
+  size_t size() const { return size_; }
+
+private:
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+};
+
+bool IsBinaryCheckpoint(const std::string &filename) {
+  char magic[sizeof(kCheckpointMagic)] = {};
+  std::ifstream is(filename, std::ios::binary);
+  is.read(magic, sizeof(magic));
+  return is && std::memcmp(magic, kCheckpointMagic, sizeof(magic)) == 0;
+}
+
+/**
+ * Reads just the header of a binary checkpoint file, unvalidated, for a
+ * quick look before loading it; zero for other files and fields older
+ * versions lack.
+ */
+CheckpointHeader ReadCheckpointHeader(const std::string &filename) {
+  CheckpointHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::ifstream is(filename, std::ios::binary);
+  is.read(reinterpret_cast<char *>(&header), sizeof(header));
+  if (std::memcmp(header.magic, kCheckpointMagic, sizeof(header.magic)) ||
+      header.header_size < kCheckpointHeaderV1Size) {
+    std::memset(&header, 0, sizeof(header));
+  } else if (header.header_size < sizeof(header)) {
+    std::memset(reinterpret_cast<char *>(&header) + header.header_size, 0,
+                sizeof(header) - header.header_size);
+  }
+  return header;
+}
+
+class BinaryCheckpointReader {
+public:
+  // Skip |validate| only for a file that was already validated.
+  explicit BinaryCheckpointReader(const std::string &filename,
+                                  bool validate = true)
+      : filename_(filename), file_(filename) {
+    if (file_.size() < kCheckpointHeaderV1Size)
+      throw std::runtime_error("Truncated checkpoint " + filename_);
+    std::memset(&header_, 0, sizeof(header_));
+    std::memcpy(&header_, file_.data(), kCheckpointHeaderV1Size);
+    if (std::memcmp(header_.magic, kCheckpointMagic, sizeof(header_.magic)) ||
+        header_.version == 0 || header_.version > kCheckpointVersion ||
+        header_.header_size < kCheckpointHeaderV1Size ||
+        header_.header_size > file_.size())
+      throw std::runtime_error("Bad checkpoint header in " + filename_);
+    std::memcpy(&header_, file_.data(),
+                std::min<size_t>(header_.header_size, sizeof(header_)));
+    pos_ = header_.header_size;
+    if (validate && header_.version >= 5)
+      Validate();
+  }
+
+  const CheckpointHeader &Header() const { return header_; }
+
+  bool Next(CheckpointRow &row) {
+    if (!NextId(row))
+      return false;
+    ReadDeps(row);
+    return true;
+  }
+
+  // Reads just the id and size of the next row; it must be followed by
+  // ReadDeps() or SkipDeps() before the next call.
+  bool NextId(CheckpointRow &row) {
+    if (read_rows_ == header_.rows)
+      return false;
+    if (header_.flags & kCheckpointGroupVarint) {
+      prev_id_ += ReadVarint();
+      row.id = prev_id_;
+      row.size = ReadVarint();
+      // Every value takes at least a byte, which bounds a corrupt deps_cnt.
+      if (row.size > file_.size() - pos_)
+        throw std::runtime_error("Truncated checkpoint " + filename_);
+    } else {
+      const uint32_t *head =
+          reinterpret_cast<const uint32_t *>(Take(2 * sizeof(uint32_t)));
+      row.id = head[0];
+      row.size = head[1];
+    }
+    read_rows_++;
+    return true;
+  }
+
+  void ReadDeps(CheckpointRow &row) {
+    if (header_.flags & kCheckpointGroupVarint) {
+      ids_.resize(row.size);
+      weights_.resize(row.size);
+      ReadGroups(ids_.data(), row.size);
+      ReadGroups(reinterpret_cast<uint32_t *>(weights_.data()), row.size);
+      for (uint32_t j = 1; j < row.size; j++) {
+        ids_[j] += ids_[j - 1];
+      }
+      row.ids = ids_.data();
+      row.weights = weights_.data();
+    } else {
+      row.ids = reinterpret_cast<const IdT *>(Take(row.size * sizeof(IdT)));
+      row.weights =
+          reinterpret_cast<const int *>(Take(row.size * sizeof(int)));
+    }
+  }
+
+  void SkipDeps(const CheckpointRow &row) {
+    if (header_.flags & kCheckpointGroupVarint) {
+      SkipGroups(row.size);
+      SkipGroups(row.size);
+    } else {
+      Take(row.size * (sizeof(IdT) + sizeof(int)));
+    }
+  }
+
+  // Where the next row starts; a reader of the same file can Seek() there.
+  CheckpointPosition Tell() const { return {pos_, read_rows_, prev_id_}; }
+
+  void Seek(const CheckpointPosition &position) {
+    pos_ = position.offset;
+    read_rows_ = position.rows;
+    prev_id_ = position.prev_id;
+  }
+
+private:
+  void Validate() {
+    CheckpointHeader header = header_;
+    header.header_crc = 0;
+    uint32_t crc =
+        Crc32c(0, reinterpret_cast<const char *>(&header),
+               std::min<size_t>(header_.header_size, sizeof(header)));
+    if (header_.header_size > sizeof(header))
+      crc = Crc32c(crc, file_.data() + sizeof(header),
+                   header_.header_size - sizeof(header));
+    if (crc != header_.header_crc)
+      throw std::runtime_error("Bad checkpoint header checksum in " +
+                               filename_);
+    if (file_.size() - pos_ != header_.data_bytes)
+      throw std::runtime_error("Truncated checkpoint " + filename_);
+    if (Crc32c(0, file_.data() + pos_, header_.data_bytes) != header_.data_crc)
+      throw std::runtime_error("Bad checkpoint checksum in " + filename_);
+  }
+
+  uint32_t ReadVarint() {
+    uint32_t res = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+      const uint8_t byte = static_cast<uint8_t>(*Take(1));
+      res |= static_cast<uint32_t>(byte & 0x7f) << shift;
+      if (!(byte & 0x80))
+        return res;
+    }
+    throw std::runtime_error("Bad varint in checkpoint " + filename_);
+  }
+
+  void SkipGroups(uint32_t count) {
+    for (uint32_t i = 0; i < count; i += 4) {
+      const uint8_t tag = static_cast<uint8_t>(*Take(1));
+      size_t bytes = 0;
+      for (uint32_t k = 0; k < 4 && i + k < count; k++) {
+        bytes += (tag >> (2 * k) & 3) + 1;
+      }
+      Take(bytes);
+    }
+  }
+
+  void ReadGroups(uint32_t *out, uint32_t count) {
+    static const uint32_t kMasks[4] = {0xff, 0xffff, 0xffffff, 0xffffffff};
+    const char *data = file_.data();
+    for (uint32_t i = 0; i < count; i += 4) {
+      const uint8_t tag = static_cast<uint8_t>(*Take(1));
+      const uint32_t group = std::min<uint32_t>(4, count - i);
+      // A full group spans at most 16 bytes; away from the end of the file
+      // each value is one unaligned 4-byte load, masked to its length.
+      if (group == 4 && file_.size() - pos_ >= 16) {
+        for (int k = 0; k < 4; k++) {
+          const int len = (tag >> (2 * k) & 3) + 1;
+          uint32_t value;
+          std::memcpy(&value, data + pos_, sizeof(value));
+          out[i + k] = value & kMasks[len - 1];
+          pos_ += len;
+        }
+        continue;
+      }
+      for (uint32_t k = 0; k < group; k++) {
+        const int len = (tag >> (2 * k) & 3) + 1;
+        const char *bytes = Take(len);
+        uint32_t value = 0;
+        std::memcpy(&value, bytes, len);
+        out[i + k] = value;
+      }
+    }
+  }
+
+  const char *Take(size_t bytes) {
+    if (file_.size() - pos_ < bytes)
+      throw std::runtime_error("Truncated checkpoint " + filename_);
+    const char *res = file_.data() + pos_;
+    pos_ += bytes;
+    return res;
+  }
+
+  const std::string filename_;
+  MappedFile file_;
+  CheckpointHeader header_;
+  size_t pos_ = 0;
+  uint64_t read_rows_ = 0;
+  // Decoded kCheckpointGroupVarint rows.
+  IdT prev_id_ = 0;
+  std::vector<IdT> ids_;
+  std::vector<int> weights_;
+};
+
+/**
+ * Reads the rows of a text checkpoint (see Save()) from a mapping. Numbers
+ * are parsed by hand: operator>> is locale-aware and many times slower.
+ */
+class TextCheckpointReader {
+public:
+  explicit TextCheckpointReader(const std::string &filename)
+      : filename_(filename), file_(filename), pos_(file_.data()),
+        end_(file_.data() + file_.size()) {
+    rows_ = ReadNumber();
+  }
+
+  uint64_t Rows() const { return rows_; }
+
+  bool Next(CheckpointRow &row) {
+    if (read_rows_ == rows_)
+      return false;
+    row.id = static_cast<IdT>(ReadNumber());
+    const int64_t size = ReadNumber();
+    // Suppose, popularity is useless
+    ReadNumber();
+    // An entry takes at least 4 bytes, which bounds a corrupt deps_cnt.
+    if (size < 0 || size > (end_ - pos_) / 4 + 1)
+      throw std::runtime_error("Truncated checkpoint " + filename_);
+    row.size = static_cast<uint32_t>(size);
+    ids_.resize(row.size);
+    weights_.resize(row.size);
+    for (uint32_t j = 0; j < row.size; j++) {
+      ids_[j] = static_cast<IdT>(ReadNumber());
+      weights_[j] = static_cast<int>(ReadNumber());
+    }
+    row.ids = ids_.data();
+    row.weights = weights_.data();
+    read_rows_++;
+    return true;
+  }
+
+  // Where the next row starts; a reader of the same file can Seek() there.
+  CheckpointPosition Tell() const {
+    return {static_cast<uint64_t>(pos_ - file_.data()), read_rows_, 0};
+  }
+
+  void Seek(const CheckpointPosition &position) {
+    pos_ = file_.data() + position.offset;
+    read_rows_ = position.rows;
+  }
+
+private:
+  int64_t ReadNumber() {
+    while (pos_ != end_ && static_cast<unsigned char>(*pos_) <= ' ') {
+      pos_++;
+    }
+    if (pos_ == end_)
+      throw std::runtime_error("Truncated checkpoint " + filename_);
+    const bool negative = *pos_ == '-';
+    if (negative)
+      pos_++;
+    const char *begin = pos_;
+    uint64_t value = 0;
+    for (unsigned digit;
+         pos_ != end_ && (digit = static_cast<unsigned char>(*pos_) - '0') < 10;
+         pos_++) {
+      value = value * 10 + digit;
+    }
+    if (pos_ == begin)
+      throw std::runtime_error("Bad number in checkpoint " + filename_);
+    return negative ? -static_cast<int64_t>(value)
+                    : static_cast<int64_t>(value);
+  }
+
+  const std::string filename_;
+  MappedFile file_;
+  const char *pos_;
+  const char *end_;
+  uint64_t rows_ = 0;
+  uint64_t read_rows_ = 0;
+  std::vector<IdT> ids_;
+  std::vector<int> weights_;
+};
+
+/**
+ * Data format: see Save()
+ */
+Data Load(const std::string &filename) {
+  TextCheckpointReader reader(filename);
+  Data res;
+  res.deps.reserve(reader.Rows());
+  CheckpointRow row;
+  while (reader.Next(row)) {
+    auto &track_deps = res.deps[row.id];
+    track_deps.reserve(row.size);
+    for (uint32_t j = 0; j < row.size; j++) {
+      if (row.ids[j] != row.id)
+        track_deps[row.ids[j]] = row.weights[j];
+    }
+  }
+  return res;
+}
+
+/**
+ * Streams rows into a binary checkpoint. Rows must come in increasing id
+ * order with deps sorted by id; the counts in the header are patched in by
+ * Finish().
+ */
+class BinaryCheckpointWriter {
+public:
+  explicit BinaryCheckpointWriter(const std::string &filename,
+                                  const CheckpointMeta &meta,
+                                  uint32_t flags = 0)
+      : filename_(filename), os_(filename, std::ios::binary) {
+    if (!os_)
+      throw std::runtime_error("Can't write " + filename_);
+    std::memset(&header_, 0, sizeof(header_));
+    std::memcpy(header_.magic, kCheckpointMagic, sizeof(header_.magic));
+    header_.version = kCheckpointVersion;
+    header_.header_size = sizeof(header_);
+    header_.flags = flags;
+    header_.meta = meta;
+    os_.write(reinterpret_cast<const char *>(&header_), sizeof(header_));
+  }
+
+  void AddRow(IdT id, const std::vector<std::pair<IdT, int>> &deps) {
+    if (header_.flags & kCheckpointGroupVarint) {
+      AddPackedRow(id, deps);
+    } else {
+      const uint32_t head[2] = {id, static_cast<uint32_t>(deps.size())};
+      Append(head, sizeof(head));
+      for (const auto &dep : deps) {
+        Append(&dep.first, sizeof(dep.first));
+      }
+      for (const auto &dep : deps) {
+        Append(&dep.second, sizeof(dep.second));
+      }
+    }
+    header_.rows++;
+    header_.entries += deps.size();
+  }
+
+  void Finish() {
+    Flush();
+    header_.memory_bytes =
+        header_.rows * kRowBytes + header_.entries * kEntryBytes;
+    header_.header_crc = 0;
+    header_.header_crc = Crc32c(0, reinterpret_cast<const char *>(&header_),
+                                sizeof(header_));
+    os_.seekp(0);
+    os_.write(reinterpret_cast<const char *>(&header_), sizeof(header_));
+    os_.close();
+    if (!os_)
+      throw std::runtime_error("Failed to write " + filename_);
+  }
+
+private:
+  void AddPackedRow(IdT id, const std::vector<std::pair<IdT, int>> &deps) {
+    AppendVarint(id - prev_id_);
+    prev_id_ = id;
+    AppendVarint(static_cast<uint32_t>(deps.size()));
+    values_.clear();
+    IdT prev_dep = 0;
+    for (const auto &dep : deps) {
+      values_.push_back(dep.first - prev_dep);
+      prev_dep = dep.first;
+    }
+    AppendGroups(values_);
+    values_.clear();
+    for (const auto &dep : deps) {
+      values_.push_back(static_cast<uint32_t>(dep.second));
+    }
+    AppendGroups(values_);
+  }
+
+  void AppendVarint(uint32_t value) {
+    for (; value >= 0x80; value >>= 7) {
+      buffer_.push_back(static_cast<char>(value | 0x80));
+    }
+    buffer_.push_back(static_cast<char>(value));
+  }
+
+  void AppendGroups(const std::vector<uint32_t> &values) {
+    for (size_t i = 0; i < values.size(); i += 4) {
+      const size_t group = std::min<size_t>(4, values.size() - i);
+      int lens[4];
+      uint8_t tag = 0;
+      for (size_t k = 0; k < group; k++) {
+        const uint32_t value = values[i + k];
+        lens[k] = value < (1u << 8)    ? 1
+                  : value < (1u << 16) ? 2
+                  : value < (1u << 24) ? 3
+                                       : 4;
+        tag |= (lens[k] - 1) << (2 * k);
+      }
+      buffer_.push_back(static_cast<char>(tag));
+      for (size_t k = 0; k < group; k++) {
+        Append(&values[i + k], lens[k]);
+      }
+    }
+  }
+
+  void Append(const void *data, size_t size) {
+    const char *bytes = static_cast<const char *>(data);
+    buffer_.insert(buffer_.end(), bytes, bytes + size);
+    if (buffer_.size() >= kWriteBufferSize)
+      Flush();
+  }
+
+  void Flush() {
+    os_.write(buffer_.data(), buffer_.size());
+    header_.data_bytes += buffer_.size();
+    header_.data_crc = Crc32c(header_.data_crc, buffer_.data(), buffer_.size());
+    buffer_.clear();
+  }
+
+  const std::string filename_;
+  std::ofstream os_;
+  CheckpointHeader header_;
+  std::vector<char> buffer_;
+  IdT prev_id_ = 0;
+  std::vector<uint32_t> values_;
+};
+
+std::string DeltaCheckpointName(const std::string &base, uint64_t sequence) {
+  return base + ".delta." + std::to_string(sequence);
+}
+
+bool FileExists(const std::string &filename) {
+  struct stat st;
+  return stat(filename.c_str(), &st) == 0;
+}
+
+std::string DirName(const std::string &filename) {
+  const auto slash = filename.find_last_of('/');
+  return slash == std::string::npos ? "." : filename.substr(0, slash);
+}
+
+void SyncPath(const std::string &path, int flags) {
+  const int fd = open(path.c_str(), flags);
+  if (fd < 0 || fsync(fd) != 0) {
+    const int error = errno;
+    if (fd >= 0)
+      close(fd);
+    throw std::runtime_error("Can't sync " + path + ": " +
+                             std::strerror(error));
+  }
+  close(fd);
+}
+
+/**
+ * Atomically replaces |filename| with the fully written |tmp_filename|:
+ * the data is synced before the rename and the directory entry after it,
+ * so a crash leaves either the old or the new checkpoint, never a prefix.
+ */
+void CommitCheckpoint(const std::string &tmp_filename,
+                      const std::string &filename) {
+  SyncPath(tmp_filename, O_RDONLY);
+  if (rename(tmp_filename.c_str(), filename.c_str()) != 0)
+    throw std::runtime_error("Can't rename " + tmp_filename + " to " +
+                             filename + ": " + std::strerror(errno));
+  SyncPath(DirName(filename), O_RDONLY | O_DIRECTORY);
+}
+
+/**
+ * Sharded checkpoint manifest, text:
+ * MRCK-SHARDS <shards_cnt>
+ * <shard_file_name>
+ * ...
+ * Shard i is a binary checkpoint of the rows with track_id % shards_cnt ==
+ * i. Shard file names are unique per save and relative to the manifest's
+ * directory, so committing the manifest switches all shards at once.
+ */
+const char kShardManifestMagic[] = "MRCK-SHARDS";
+
+bool IsShardManifest(const std::string &filename) {
+  std::ifstream is(filename);
+  std::string magic;
+  return is >> magic && magic == kShardManifestMagic;
+}
+
+// The files holding the rows of checkpoint |filename|.
+std::vector<std::string> CheckpointFiles(const std::string &filename) {
+  if (!IsShardManifest(filename))
+    return {filename};
+  std::ifstream is(filename);
+  std::string magic;
+  size_t shards_cnt = 0;
+  is >> magic >> shards_cnt;
+  std::vector<std::string> files;
+  std::string name;
+  while (files.size() < shards_cnt && is >> name) {
+    files.push_back(DirName(filename) + "/" + name);
+  }
+  if (files.size() != shards_cnt)
+    throw std::runtime_error("Truncated shard manifest " + filename);
+  return files;
+}
+
+// Returns false if there was no such checkpoint.
+bool RemoveCheckpoint(const std::string &filename) {
+  if (!FileExists(filename))
+    return false;
+  for (const auto &file : CheckpointFiles(filename)) {
+    if (file != filename)
+      unlink(file.c_str());
+  }
+  return unlink(filename.c_str()) == 0;
+}
+
+// Commits |tmp_filename| as |filename| and drops the shards it replaced.
+void ReplaceCheckpoint(const std::string &tmp_filename,
+                       const std::string &filename) {
+  std::vector<std::string> old_shards;
+  if (FileExists(filename) && IsShardManifest(filename))
+    old_shards = CheckpointFiles(filename);
+  CommitCheckpoint(tmp_filename, filename);
+  for (const auto &shard : old_shards) {
+    unlink(shard.c_str());
+  }
+}
+
+/**
+ * Writes the rows of |parts| with id % shards == shard in checkpoint
+ * order. With |only_rows| only those rows are written, absent ones with no
+ * deps, as a delta needs.
+ */
+void WriteSortedRows(const std::vector<const SparseMatrix *> &parts,
+                     BinaryCheckpointWriter &writer, int shard, int shards,
+                     const std::unordered_set<IdT> *only_rows) {
+  using RowRef = std::pair<IdT, const std::unordered_map<IdT, int> *>;
+  std::vector<RowRef> rows;
+  if (only_rows) {
+    for (const auto id : *only_rows) {
+      if (static_cast<int>(id % shards) != shard)
+        continue;
+      const std::unordered_map<IdT, int> *row = nullptr;
+      for (const auto *part : parts) {
+        const auto it = part->find(id);
+        if (it != part->end())
+          row = &it->second;
+      }
+      rows.emplace_back(id, row);
+    }
+  } else {
+    for (const auto *part : parts) {
+      for (const auto &it : *part) {
+        if (static_cast<int>(it.first % shards) == shard)
+          rows.emplace_back(it.first, &it.second);
+      }
+    }
+  }
+  std::sort(rows.begin(), rows.end(),
+            [](const RowRef &lhs, const RowRef &rhs) {
+              return lhs.first < rhs.first;
+            });
+  std::vector<std::pair<IdT, int>> deps;
+  for (const auto &row : rows) {
+    deps.clear();
+    if (row.second)
+      deps.assign(row.second->begin(), row.second->end());
+    std::sort(deps.begin(), deps.end());
+    writer.AddRow(row.first, deps);
+  }
+}
+
+// write_rows(writer, shard, shards) emits the sorted rows of one shard.
+using ShardRowsWriter =
+    std::function<void(BinaryCheckpointWriter &, int, int)>;
+
+/**
+ * Atomically writes binary checkpoint |filename|: a single file, or with
+ * |shards| > 1 that many shard files written by as many threads plus a
+ * manifest.
+ */
+void WriteBinaryCheckpoint(const std::string &filename,
+                           const CheckpointMeta &meta, uint32_t flags,
+                           const ShardRowsWriter &write_rows,
+                           int shards = kCheckpointShards) {
+  if (kCheckpointFormat == CheckpointFormat::kPacked)
+    flags |= kCheckpointGroupVarint;
+  const std::string tmp_filename = filename + ".tmp";
+  if (shards <= 1) {
+    BinaryCheckpointWriter writer(tmp_filename, meta, flags);
+    write_rows(writer, 0, 1);
+    writer.Finish();
+    ReplaceCheckpoint(tmp_filename, filename);
+    return;
+  }
+  const std::string nonce = std::to_string(
+      std::chrono::system_clock::now().time_since_epoch().count());
+  std::vector<std::string> names(shards);
+  for (int shard = 0; shard < shards; shard++) {
+    const auto slash = filename.find_last_of('/');
+    names[shard] = filename.substr(slash == std::string::npos ? 0 : slash + 1) +
+                   "." + nonce + ".shard" + std::to_string(shard);
+  }
+  RunWorkers(shards, [&](int shard) {
+    const std::string path = DirName(filename) + "/" + names[shard];
+    BinaryCheckpointWriter writer(path, meta, flags);
+    write_rows(writer, shard, shards);
+    writer.Finish();
+    SyncPath(path, O_RDONLY);
+  });
+  {
+    std::ofstream os(tmp_filename);
+    os << kShardManifestMagic << ' ' << shards << std::endl;
+    for (const auto &name : names) {
+      os << name << std::endl;
+    }
+    os.close();
+    if (!os)
+      throw std::runtime_error("Failed to write " + tmp_filename);
+  }
+  ReplaceCheckpoint(tmp_filename, filename);
+}
+
+/**
+ * Atomically writes the rows of |parts| as checkpoint |filename| in
+ * kCheckpointFormat, or, with |only_rows|, a delta of just those rows.
+ */
+void SaveCheckpoint(const std::vector<const SparseMatrix *> &parts,
+                    const std::string &filename,
+                    const CheckpointMeta &meta = CheckpointMeta(),
+                    const std::unordered_set<IdT> *only_rows = nullptr) {
+  if (kCheckpointFormat == CheckpointFormat::kText) {
+    if (only_rows)
+      throw std::runtime_error("Delta checkpoints need the binary format");
+    Save(parts, filename + ".tmp");
+    ReplaceCheckpoint(filename + ".tmp", filename);
+    return;
+  }
+  WriteBinaryCheckpoint(
+      filename, meta, only_rows ? kCheckpointDelta : 0,
+      [&parts, only_rows](BinaryCheckpointWriter &writer, int shard,
+                          int shards) {
+        WriteSortedRows(parts, writer, shard, shards, only_rows);
+      });
+}
+
+void SaveCheckpoint(const Data &data, const std::string &filename) {
+  SaveCheckpoint(std::vector<const SparseMatrix *>{&data.deps}, filename);
+}
+
+// Loads one binary checkpoint file (not a manifest).
+Data LoadBinary(const std::string &filename) {
+  BinaryCheckpointReader reader(filename);
+  Data res;
+  res.deps.reserve(reader.Header().rows);
+  CheckpointRow row;
+  while (reader.Next(row)) {
+    auto &track_deps = res.deps[row.id];
+    track_deps.reserve(row.size);
+    for (uint32_t j = 0; j < row.size; j++) {
+      if (row.ids[j] != row.id)
+        track_deps.emplace(row.ids[j], row.weights[j]);
+    }
+  }
+  return res;
+}
+
+/**
+ * Loads a checkpoint written in any CheckpointFormat. The shards of a
+ * sharded checkpoint are loaded by one thread each; they hold disjoint
+ * rows, so joining them only moves rows.
+ */
+Data LoadCheckpoint(const std::string &filename) {
+  const auto files = CheckpointFiles(filename);
+  uint64_t memory_bytes = 0;
+  for (const auto &file : files) {
+    memory_bytes += ReadCheckpointHeader(file).memory_bytes;
+  }
+  CheckMemory(memory_bytes, filename);
+  if (files.size() == 1)
+    return IsBinaryCheckpoint(filename) ? LoadBinary(filename)
+                                        : Load(filename);
+  std::vector<Data> shards(files.size());
+  RunWorkers(static_cast<int>(files.size()), [&files, &shards](int shard) {
+    shards[shard] = LoadBinary(files[shard]);
+  });
+  size_t rows = 0;
+  for (const auto &shard : shards) {
+    rows += shard.deps.size();
+  }
+  Data res;
+  res.deps.reserve(rows);
+  for (auto &shard : shards) {
+    res.deps.insert(std::make_move_iterator(shard.deps.begin()),
+                    std::make_move_iterator(shard.deps.end()));
+    shard.deps.clear();
+  }
+  return res;
+}
+
+// Meta of a binary or sharded checkpoint; zero for a text one.
+CheckpointMeta ReadCheckpointMeta(const std::string &filename) {
+  return ReadCheckpointHeader(CheckpointFiles(filename).front()).meta;
+}
+
+/**
+ * Calls fn(filename) for |base| and then for each delta checkpoint written
+ * after it, in order, until the first missing one. Deltas left over from
+ * before the base have lower sequence numbers and are skipped. Returns the
+ * meta of the last file, which is zero for text checkpoints.
+ */
+template <typename F>
+CheckpointMeta ForEachCheckpointInChain(const std::string &base, F fn) {
+  fn(base);
+  CheckpointMeta meta = ReadCheckpointMeta(base);
+  if (!meta.sequence)
+    return meta;
+  std::string delta;
+  while (FileExists(delta = DeltaCheckpointName(base, meta.sequence + 1))) {
+    fn(delta);
+    meta = ReadCheckpointMeta(delta);
+  }
+  return meta;
+}
+
+CheckpointMeta ReadCheckpointChainMeta(const std::string &base) {
+  return ForEachCheckpointInChain(base, [](const std::string &) {});
+}
+
+// Loads |base| with its deltas replayed; see ForEachCheckpointInChain().
+Data LoadCheckpointChain(const std::string &base, CheckpointMeta *meta) {
+  Data res;
+  *meta = ForEachCheckpointInChain(base, [&res, &base](
+                                             const std::string &filename) {
+    if (filename == base) {
+      res = LoadCheckpoint(base);
+      return;
+    }
+    // Delta rows replace whole rows; a row without deps was deleted.
+    Data delta = LoadCheckpoint(filename);
+    for (auto &it : delta.deps) {
+      if (it.second.empty()) {
+        res.deps.erase(it.first);
+      } else {
+        res.deps[it.first] = std::move(it.second);
+      }
+    }
+  });
+  return res;
+}
+
+/**
+ * The delta checkpoints of |base| on disk by sequence number, found by
+ * listing: after failed or interrupted dumps they need not be contiguous.
+ */
+std::vector<std::pair<uint64_t, std::string>>
+ListDeltaCheckpoints(const std::string &base) {
+  std::vector<std::pair<uint64_t, std::string>> deltas;
+  const std::string prefix = DeltaCheckpointName(base, 0);
+  const size_t digits_at = prefix.size() - 1;
+  glob_t matches;
+  if (glob((prefix.substr(0, digits_at) + "*").c_str(), 0, nullptr,
+           &matches) != 0)
+    return deltas;
+  std::vector<std::string> paths(matches.gl_pathv,
+                                 matches.gl_pathv + matches.gl_pathc);
+  globfree(&matches);
+  for (const auto &path : paths) {
+    const std::string digits = path.substr(digits_at);
+    // Skips .tmp files and shard files, which go with their manifest.
+    if (digits.empty() ||
+        digits.find_first_not_of("0123456789") != std::string::npos)
+      continue;
+    deltas.emplace_back(std::stoull(digits), path);
+  }
+  return deltas;
+}
+
+/**
+ * Drops the deltas after |sequence|, left by an earlier run that got
+ * further, before a full checkpoint with |sequence| is written: the chain
+ * would replay them on top of it. Deleting them first keeps the chain on
+ * disk consistent if the write is interrupted.
+ */
+void RemoveLaterDeltaCheckpoints(const std::string &base, uint64_t sequence) {
+  for (const auto &delta : ListDeltaCheckpoints(base)) {
+    if (delta.first > sequence)
+      RemoveCheckpoint(delta.second);
+  }
+}
+
+// Drops the deltas superseded by a full checkpoint with |sequence|.
+void RemoveDeltaCheckpoints(const std::string &base, uint64_t sequence) {
+  for (const auto &delta : ListDeltaCheckpoints(base)) {
+    if (delta.first < sequence)
+      RemoveCheckpoint(delta.second);
+  }
+}
+
+// Id of the user on |line|, read without parsing the tracks.
+IdT ParseUserId(const std::string &line) {
+  static const int kIdIdx = 11;
+  const auto id_e_p = line.find("u;");
+  return static_cast<IdT>(std::stoi(line.substr(kIdIdx, id_e_p - kIdIdx)));
+}
+
+User ParseUser(const std::string &line) {
+  User res{ParseUserId(line)};
+  auto tr_s_p = line.find("u;") + 15;
+  auto tr_e_p = line.find(";", tr_s_p);
+  auto tracks_e_p = line.rfind("]");
+  while (tr_e_p < tracks_e_p) {
+    res.tracks.push_back(
+        static_cast<IdT>(std::stoi(line.substr(tr_s_p, tr_e_p - tr_s_p))));
+    tr_s_p = tr_e_p + 1;
+    tr_e_p = line.find(";", tr_s_p);
+  }
+
+  return res;
+}
+
+int PairRows(const User &user) { return static_cast<int>(user.tracks.size()); }
+
+// Pairs contributed by tracks [row_begin, row_end) of the user.
+template <typename F>
+void ForEachPair(const User &user, F add, int row_begin, int row_end) {
+  for (int i = row_begin; i < row_end; i++) {
+    auto upper_bound =
+        std::min(static_cast<int>(user.tracks.size()), i + kDepShift);
+    for (int j = i; j < upper_bound; j++) {
+      add(user.tracks[i], user.tracks[j], kDepShift - (j - i));
+    }
+  }
+}
+
+template <typename F> void ForEachPair(const User &user, F add) {
+  ForEachPair(user, add, 0, PairRows(user));
+}
+
+size_t PairCount(const User &user, int row_begin, int row_end) {
+  size_t pairs = 0;
+  for (int i = row_begin; i < row_end; i++) {
+    pairs += std::min(PairRows(user) - i, kDepShift);
+  }
+  return pairs;
+}
+
+/**
+ * Per-worker task deques. A worker pops from the front of its own deque;
+ * once that is empty it steals the back half of another worker's deque.
+ * Tasks are dealt in contiguous blocks, so a worker mostly walks adjacent
+ * input until it has to help someone else.
+ */
+template <typename Task> class WorkStealingQueue {
+public:
+  WorkStealingQueue(std::vector<Task> &&tasks, int workers)
+      : deques_(workers) {
+    const size_t block = (tasks.size() + workers - 1) / workers;
+    for (size_t i = 0; i < tasks.size(); i++) {
+      deques_[i / block].tasks.push_back(std::move(tasks[i]));
+    }
+  }
+
+  bool Pop(int worker, Task &task) {
+    if (PopFront(worker, task))
+      return true;
+    const int workers = static_cast<int>(deques_.size());
+    for (int shift = 1; shift < workers; shift++) {
+      if (Steal((worker + shift) % workers, worker))
+        return PopFront(worker, task);
+    }
+    return false;
+  }
+
+private:
+  struct Deque {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  bool PopFront(int worker, Task &task) {
+    auto &own = deques_[worker];
+    std::lock_guard<std::mutex> lock(own.mutex);
+    if (own.tasks.empty())
+      return false;
+    task = std::move(own.tasks.front());
+    own.tasks.pop_front();
+    return true;
+  }
+
+  bool Steal(int victim, int thief) {
+    std::vector<Task> loot;
+    {
+      auto &from = deques_[victim];
+      std::lock_guard<std::mutex> lock(from.mutex);
+      const size_t take = (from.tasks.size() + 1) / 2;
+      for (size_t i = 0; i < take; i++) {
+        loot.push_back(std::move(from.tasks.back()));
+        from.tasks.pop_back();
+      }
+    }
+    if (loot.empty())
+      return false;
+    auto &to = deques_[thief];
+    std::lock_guard<std::mutex> lock(to.mutex);
+    for (auto it = loot.rbegin(); it != loot.rend(); it++) {
+      to.tasks.push_back(std::move(*it));
+    }
+    return true;
+  }
+
+  std::vector<Deque> deques_;
+};
+
+/**
+ * Pair work for users[user_begin, user_end), or for track rows
+ * [row_begin, row_end) of a single user when that user alone is heavier
+ * than kTaskPairs.
+ */
+struct PairTask {
+  size_t user_begin;
+  size_t user_end;
+  int row_begin;
+  int row_end;
+
+  // A split user is accounted for by the slice that finishes it.
+  size_t Users(const std::vector<User> &users) const {
+    if (row_end)
+      return row_end == PairRows(users[user_begin]) ? 1 : 0;
+    return user_end - user_begin;
+  }
+
+  size_t Pairs(const std::vector<User> &users) const {
+    if (row_end)
+      return PairCount(users[user_begin], row_begin, row_end);
+    size_t pairs = 0;
+    for (size_t u = user_begin; u < user_end; u++) {
+      pairs += PairCount(users[u], 0, PairRows(users[u]));
+    }
+    return pairs;
+  }
+
+  template <typename F>
+  void ForEachPair(const std::vector<User> &users, F add) const {
+    if (row_end) {
+      ::ForEachPair(users[user_begin], add, row_begin, row_end);
+      return;
+    }
+    for (size_t u = user_begin; u < user_end; u++) {
+      ::ForEachPair(users[u], add);
+    }
+  }
+};
+
+// Splits users[begin, end) into tasks of about kTaskPairs pairs each.
+std::vector<PairTask> MakePairTasks(const std::vector<User> &users,
+                                    size_t begin, size_t end) {
+  static const int kRowsPerTask = kTaskPairs / kDepShift;
+  std::vector<PairTask> tasks;
+  size_t chunk_begin = begin;
+  size_t chunk_pairs = 0;
+  for (size_t u = begin; u < end; u++) {
+    const int rows = PairRows(users[u]);
+    const size_t pairs = static_cast<size_t>(rows) * kDepShift;
+    if (pairs > static_cast<size_t>(kTaskPairs)) {
+      if (chunk_begin < u)
+        tasks.push_back({chunk_begin, u, 0, 0});
+      for (int row = 0; row < rows; row += kRowsPerTask) {
+        tasks.push_back({u, u + 1, row, std::min(rows, row + kRowsPerTask)});
+      }
+      chunk_begin = u + 1;
+      chunk_pairs = 0;
+      continue;
+    }
+    chunk_pairs += pairs;
+    if (chunk_pairs >= static_cast<size_t>(kTaskPairs)) {
+      tasks.push_back({chunk_begin, u + 1, 0, 0});
+      chunk_begin = u + 1;
+      chunk_pairs = 0;
+    }
+  }
+  if (chunk_begin < end)
+    tasks.push_back({chunk_begin, end, 0, 0});
+  return tasks;
+}
+
+/**
+ * Open-addressing (track, track) -> weight table shared by all training
+ * threads. A slot is claimed with a CAS on its key and the weight is bumped
+ * with fetch_add, so writers never take a lock. The table does not grow
+ * while it is being written: once it is full Add() refuses new keys and the
+ * caller keeps them aside until the writers are joined.
+ * Key (~0u, ~0u) is reserved as the empty marker.
+ */
+class ConcurrentPairTable {
+public:
+  explicit ConcurrentPairTable(size_t capacity) {
+    size_t pow2 = 1;
+    while (pow2 < capacity)
+      pow2 <<= 1;
+    mask_ = pow2 - 1;
+    max_size_ = pow2 / 10 * 7;
+    keys_.reset(new std::atomic<uint64_t>[pow2]);
+    weights_.reset(new std::atomic<int>[pow2]);
+    for (size_t i = 0; i < pow2; i++) {
+      keys_[i].store(kEmpty, std::memory_order_relaxed);
+      weights_[i].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  bool Add(IdT src, IdT dst, int weight) {
+    const uint64_t key = (static_cast<uint64_t>(src) << 32) | dst;
+    size_t pos = Hash(key) & mask_;
+    for (size_t probes = 0; probes <= mask_; probes++) {
+      uint64_t cur = keys_[pos].load(std::memory_order_relaxed);
+      if (cur == kEmpty) {
+        if (size_.load(std::memory_order_relaxed) >= max_size_)
+          return false;
+        if (keys_[pos].compare_exchange_strong(cur, key,
+                                               std::memory_order_relaxed)) {
+          size_.fetch_add(1, std::memory_order_relaxed);
+          cur = key;
+        }
+      }
+      if (cur == key) {
+        weights_[pos].fetch_add(weight, std::memory_order_relaxed);
+        return true;
+      }
+      pos = (pos + 1) & mask_;
+    }
+    return false;
+  }
+
+  size_t Size() const { return size_.load(std::memory_order_relaxed); }
+  size_t Capacity() const { return mask_ + 1; }
+
+  // Not safe against concurrent Add(): call it between rounds only.
+  template <typename F> void ForEach(F fn) const {
+    for (size_t i = 0; i <= mask_; i++) {
+      const uint64_t key = keys_[i].load(std::memory_order_relaxed);
+      if (key != kEmpty)
+        fn(static_cast<IdT>(key >> 32), static_cast<IdT>(key),
+           weights_[i].load(std::memory_order_relaxed));
+    }
+  }
+
+private:
+  static const uint64_t kEmpty = ~0ull;
+
+  static uint64_t Hash(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ull;
+    key ^= key >> 33;
+    return key;
+  }
+
+  size_t mask_;
+  size_t max_size_;
+  std::unique_ptr<std::atomic<uint64_t>[]> keys_;
+  std::unique_ptr<std::atomic<int>[]> weights_;
+  std::atomic<size_t> size_{0};
+};
+
+// Training throughput counters, bumped once per task rather than per pair.
+struct TrainProgress {
+  std::atomic<size_t> users{0};
+  std::atomic<size_t> pairs{0};
+
+  void Add(size_t task_users, size_t task_pairs) {
+    users.fetch_add(task_users, std::memory_order_relaxed);
+    pairs.fetch_add(task_pairs, std::memory_order_relaxed);
+  }
+};
+
+/**
+ * Row and entry counts of a SparseMatrix, kept up to date as it is written
+ * so that reporting its size does not have to walk it. Each instance has a
+ * single writer; other threads only read.
+ */
+struct MatrixStats {
+  std::atomic<size_t> rows{0};
+  std::atomic<size_t> entries{0};
+
+  void Set(const SparseMatrix &matrix) {
+    rows.store(matrix.size(), std::memory_order_relaxed);
+    entries.store(CalcSize(matrix), std::memory_order_relaxed);
+  }
+  size_t Bytes() const {
+    return rows.load(std::memory_order_relaxed) * kRowBytes +
+           entries.load(std::memory_order_relaxed) * kEntryBytes;
+  }
+};
+
+void AddPair(SparseMatrix &matrix, MatrixStats &stats, IdT src, IdT dst,
+             int weight) {
+  auto it = matrix.find(src);
+  if (it == matrix.end()) {
+    it = matrix.emplace(src, std::unordered_map<IdT, int>()).first;
+    stats.rows.store(stats.rows.load(std::memory_order_relaxed) + 1,
+                     std::memory_order_relaxed);
+  }
+  auto jt = it->second.find(dst);
+  if (jt == it->second.end()) {
+    it->second.emplace(dst, weight);
+    stats.entries.store(stats.entries.load(std::memory_order_relaxed) + 1,
+                        std::memory_order_relaxed);
+  } else {
+    jt->second += weight;
+  }
+}
+
+/**
+ * Pair counts accumulated by ConstructData. Count() is called for
+ * consecutive ranges of users; between calls nothing else touches the
+ * matrix, so Reduce()/Save() need no synchronisation. Size() and Bytes()
+ * are cheap and may be called from another thread at any time.
+ */
+class TrainMatrix {
+public:
+  virtual ~TrainMatrix() = default;
+  virtual void Count(const std::vector<User> &users, size_t begin,
+                     size_t end, TrainProgress &progress) = 0;
+  virtual size_t Size() const = 0;
+  virtual size_t Bytes() const = 0;
+  // Rows that lose entries are added to |touched| if it is set.
+  virtual int Reduce(int threshold, std::unordered_set<IdT> *touched) = 0;
+  // Atomically writes a full checkpoint, or a delta of |only_rows| if it is
+  // set; see SaveCheckpoint().
+  virtual void Save(const std::string &filename, const CheckpointMeta &meta,
+                    const std::unordered_set<IdT> *only_rows) const = 0;
+  virtual void Assign(Data &&data) = 0;
+  virtual Data Release() = 0;
+};
+
+class LocalTrainMatrix : public TrainMatrix {
+public:
+  void Count(const std::vector<User> &users, size_t begin, size_t end,
+             TrainProgress &progress) override {
+    for (size_t u = begin; u < end; u++) {
+      ForEachPair(users[u], [this](IdT src, IdT dst, int weight) {
+        AddPair(data_.deps, stats_, src, dst, weight);
+      });
+      progress.Add(1, PairCount(users[u], 0, PairRows(users[u])));
+    }
+  }
+  size_t Size() const override {
+    return stats_.entries.load(std::memory_order_relaxed);
+  }
+  size_t Bytes() const override { return stats_.Bytes(); }
+  int Reduce(int threshold, std::unordered_set<IdT> *touched) override {
+    const int removed = ::Reduce(data_.deps, threshold, touched);
+    stats_.rows.store(data_.deps.size(), std::memory_order_relaxed);
+    stats_.entries.store(Size() - removed, std::memory_order_relaxed);
+    return removed;
+  }
+  void Save(const std::string &filename, const CheckpointMeta &meta,
+            const std::unordered_set<IdT> *only_rows) const override {
+    ::SaveCheckpoint({&data_.deps}, filename, meta, only_rows);
+  }
+  void Assign(Data &&data) override {
+    data_ = std::move(data);
+    stats_.Set(data_.deps);
+  }
+  Data Release() override {
+    stats_.rows = 0;
+    stats_.entries = 0;
+    return std::move(data_);
+  }
+
+private:
+  Data data_;
+  MatrixStats stats_;
+};
+
+/**
+ * All kWorkerThreads threads write into one ConcurrentPairTable, so popular
+ * pairs are stored once instead of once per thread and there is no merge
+ * phase. Users are handed out as PairTasks through a WorkStealingQueue.
+ */
+class SharedTrainMatrix : public TrainMatrix {
+public:
+  explicit SharedTrainMatrix(int threads)
+      : threads_(threads),
+        table_(new ConcurrentPairTable(kSharedTableInitialCapacity)) {}
+
+  void Count(const std::vector<User> &users, size_t begin, size_t end,
+             TrainProgress &progress) override {
+    WorkStealingQueue<PairTask> queue(MakePairTasks(users, begin, end),
+                                      threads_);
+    std::vector<SparseMatrix> spills(threads_);
+    RunWorkers(threads_, [this, &users, &queue, &spills, &progress](int self) {
+      auto &spill = spills[self];
+      PairTask task;
+      while (queue.Pop(self, task)) {
+        task.ForEachPair(users, [this, &spill](IdT src, IdT dst, int weight) {
+          if (!table_->Add(src, dst, weight))
+            spill[src][dst] += weight;
+        });
+        progress.Add(task.Users(users), task.Pairs(users));
+      }
+    });
+    size_t spilled = 0;
+    for (const auto &spill : spills) {
+      spilled += CalcSize(spill);
+    }
+    if (spilled) {
+      Rebuild(2 * (table_->Size() + spilled), 0);
+      for (const auto &spill : spills) {
+        for (const auto &it : spill) {
+          for (const auto &jt : it.second) {
+            table_->Add(it.first, jt.first, jt.second);
+          }
+        }
+      }
+    }
+  }
+
+  size_t Size() const override {
+    std::lock_guard<std::mutex> lock(table_mutex_);
+    return table_->Size();
+  }
+
+  size_t Bytes() const override {
+    std::lock_guard<std::mutex> lock(table_mutex_);
+    return table_->Capacity() * (sizeof(uint64_t) + sizeof(int));
+  }
+
+  int Reduce(int threshold, std::unordered_set<IdT> *touched) override {
+    const size_t before = table_->Size();
+    Rebuild(table_->Capacity(), threshold, touched);
+    return static_cast<int>(before - table_->Size());
+  }
+
+  void Save(const std::string &filename, const CheckpointMeta &meta,
+            const std::unordered_set<IdT> *only_rows) const override {
+    if (kCheckpointFormat == CheckpointFormat::kText) {
+      const Data data = ToData();
+      ::SaveCheckpoint({&data.deps}, filename, meta, only_rows);
+      return;
+    }
+    // Sorting the packed (src, dst) keys puts entries in file order.
+    std::vector<std::pair<uint64_t, int>> entries;
+    // No Size(): this may run in a fork()ed child, where table_mutex_ could
+    // be stuck locked by a thread that does not exist there.
+    entries.reserve(only_rows ? 0 : table_->Size());
+    table_->ForEach([&entries, only_rows](IdT src, IdT dst, int weight) {
+      if (!only_rows || only_rows->count(src))
+        entries.emplace_back((static_cast<uint64_t>(src) << 32) | dst,
+                             weight);
+    });
+    std::sort(entries.begin(), entries.end());
+    // A delta also lists its rows that are now gone, with no deps.
+    std::vector<IdT> rows;
+    if (only_rows) {
+      rows.assign(only_rows->begin(), only_rows->end());
+      std::sort(rows.begin(), rows.end());
+    }
+    WriteBinaryCheckpoint(
+        filename, meta, only_rows ? kCheckpointDelta : 0,
+        [&entries, &rows](BinaryCheckpointWriter &writer, int shard,
+                          int shards) {
+          auto in_shard = [shard, shards](IdT id) {
+            return static_cast<int>(id % shards) == shard;
+          };
+          std::vector<std::pair<IdT, int>> deps;
+          auto next_row = rows.begin();
+          for (size_t i = 0; i < entries.size();) {
+            const IdT src = static_cast<IdT>(entries[i].first >> 32);
+            for (; next_row != rows.end() && *next_row <= src; next_row++) {
+              if (*next_row < src && in_shard(*next_row))
+                writer.AddRow(*next_row, {});
+            }
+            deps.clear();
+            for (; i < entries.size() && (entries[i].first >> 32) == src;
+                 i++) {
+              deps.emplace_back(static_cast<IdT>(entries[i].first),
+                                entries[i].second);
+            }
+            if (in_shard(src))
+              writer.AddRow(src, deps);
+          }
+          for (; next_row != rows.end(); next_row++) {
+            if (in_shard(*next_row))
+              writer.AddRow(*next_row, {});
+          }
+        });
+  }
+
+  void Assign(Data &&data) override {
+    std::unique_ptr<ConcurrentPairTable> next(
+        new ConcurrentPairTable(std::max(kSharedTableInitialCapacity,
+                                         2 * CalcSize(data.deps))));
+    for (const auto &it : data.deps) {
+      for (const auto &jt : it.second) {
+        next->Add(it.first, jt.first, jt.second);
+      }
+    }
+    Swap(std::move(next));
+  }
+
+  Data Release() override {
+    Data res = ToData();
+    Swap(std::unique_ptr<ConcurrentPairTable>(new ConcurrentPairTable(1)));
+    return res;
+  }
+
+private:
+  // Rehashes into a table of at least |capacity| slots, dropping entries
+  // lighter than |threshold|.
+  void Rebuild(size_t capacity, int threshold,
+               std::unordered_set<IdT> *touched = nullptr) {
+    std::unique_ptr<ConcurrentPairTable> next(new ConcurrentPairTable(
+        std::max(capacity, kSharedTableInitialCapacity)));
+    table_->ForEach([&next, threshold, touched](IdT src, IdT dst, int weight) {
+      if (weight >= threshold) {
+        next->Add(src, dst, weight);
+      } else if (touched) {
+        touched->insert(src);
+      }
+    });
+    Swap(std::move(next));
+  }
+
+  // Size()/Bytes() may read table_ from the progress thread.
+  void Swap(std::unique_ptr<ConcurrentPairTable> &&next) {
+    std::lock_guard<std::mutex> lock(table_mutex_);
+    table_.swap(next);
+  }
+
+  Data ToData() const {
+    Data res;
+    table_->ForEach([&res](IdT src, IdT dst, int weight) {
+      res.deps[src][dst] = weight;
+    });
+    return res;
+  }
+
+  int threads_;
+  std::unique_ptr<ConcurrentPairTable> table_;
+  mutable std::mutex table_mutex_;
+};
+
+struct PairUpdate {
+  IdT src;
+  IdT dst;
+  int weight;
+};
+
+/**
+ * Rows are partitioned by src % threads and every training thread owns one
+ * partition. A thread scanning users applies updates for its own rows
+ * directly and buffers the others into per-destination outboxes of
+ * kOutboxSize updates. Full outboxes are pushed to the owner's inbox and
+ * applied by the owner between its own chunks, so every partition is only
+ * ever written by one thread.
+ */
+class RoutedTrainMatrix : public TrainMatrix {
+public:
+  explicit RoutedTrainMatrix(int threads)
+      : parts_(threads), stats_(threads) {}
+
+  void Count(const std::vector<User> &users, size_t begin, size_t end,
+             TrainProgress &progress) override {
+    const size_t shards = parts_.size();
+    std::vector<Inbox> inboxes(shards);
+    WorkStealingQueue<PairTask> queue(MakePairTasks(users, begin, end),
+                                      static_cast<int>(shards));
+    std::atomic<size_t> producing{shards};
+    RunWorkers(static_cast<int>(shards), [&, this](int worker) {
+      const size_t self = worker;
+      auto &own = parts_[self].deps;
+      auto &own_stats = stats_[self];
+      auto &inbox = inboxes[self];
+      std::vector<std::vector<PairUpdate>> outboxes(shards);
+      auto deliver = [&](size_t shard) {
+        {
+          std::lock_guard<std::mutex> lock(inboxes[shard].mutex);
+          inboxes[shard].batches.push_back(std::move(outboxes[shard]));
+        }
+        inboxes[shard].cv.notify_one();
+        outboxes[shard] = std::vector<PairUpdate>();
+        outboxes[shard].reserve(kOutboxSize);
+      };
+      auto drain = [&]() {
+        std::vector<std::vector<PairUpdate>> batches;
+        {
+          std::lock_guard<std::mutex> lock(inbox.mutex);
+          batches.swap(inbox.batches);
+        }
+        for (const auto &batch : batches) {
+          for (const auto &update : batch) {
+            AddPair(own, own_stats, update.src, update.dst, update.weight);
+          }
+        }
+      };
+      for (auto &outbox : outboxes) {
+        outbox.reserve(kOutboxSize);
+      }
+      PairTask task;
+      while (queue.Pop(worker, task)) {
+        task.ForEachPair(users, [&](IdT src, IdT dst, int weight) {
+          const size_t shard = src % shards;
+          if (shard == self) {
+            AddPair(own, own_stats, src, dst, weight);
+            return;
+          }
+          outboxes[shard].push_back({src, dst, weight});
+          if (outboxes[shard].size() == kOutboxSize)
+            deliver(shard);
+        });
+        progress.Add(task.Users(users), task.Pairs(users));
+        drain();
+      }
+      for (size_t shard = 0; shard < shards; shard++) {
+        if (shard != self && !outboxes[shard].empty())
+          deliver(shard);
+      }
+      if (producing.fetch_sub(1) == 1) {
+        for (auto &box : inboxes) {
+          std::lock_guard<std::mutex> lock(box.mutex);
+          box.cv.notify_all();
+        }
+      }
+      // Other threads may still be routing updates to us.
+      while (true) {
+        {
+          std::unique_lock<std::mutex> lock(inbox.mutex);
+          inbox.cv.wait(lock, [&]() {
+            return !inbox.batches.empty() || producing.load() == 0;
+          });
+        }
+        const bool last = producing.load() == 0;
+        drain();
+        if (last)
+          break;
+      }
+    });
+  }
+
+  size_t Size() const override {
+    size_t size = 0;
+    for (const auto &stats : stats_) {
+      size += stats.entries.load(std::memory_order_relaxed);
+    }
+    return size;
+  }
+
+  size_t Bytes() const override {
+    size_t bytes = 0;
+    for (const auto &stats : stats_) {
+      bytes += stats.Bytes();
+    }
+    return bytes;
+  }
+
+  int Reduce(int threshold, std::unordered_set<IdT> *touched) override {
+    std::vector<std::unordered_set<IdT>> part_touched(parts_.size());
+    std::vector<std::future<int>> futures;
+    for (size_t p = 0; p < parts_.size(); p++) {
+      futures.push_back(std::async(std::launch::async, [&, this, p]() {
+        auto &deps = parts_[p].deps;
+        const int removed =
+            ::Reduce(deps, threshold, touched ? &part_touched[p] : nullptr);
+        stats_[p].rows.store(deps.size(), std::memory_order_relaxed);
+        stats_[p].entries.store(stats_[p].entries.load() - removed,
+                                std::memory_order_relaxed);
+        return removed;
+      }));
+    }
+    int removed = 0;
+    for (auto &fut : futures) {
+      removed += fut.get();
+    }
+    if (touched) {
+      for (const auto &rows : part_touched) {
+        touched->insert(rows.begin(), rows.end());
+      }
+    }
+    return removed;
+  }
+
+  void Save(const std::string &filename, const CheckpointMeta &meta,
+            const std::unordered_set<IdT> *only_rows) const override {
+    std::vector<const SparseMatrix *> parts;
+    for (const auto &part : parts_) {
+      parts.push_back(&part.deps);
+    }
+    ::SaveCheckpoint(parts, filename, meta, only_rows);
+  }
+
+  void Assign(Data &&data) override {
+    for (auto &part : parts_) {
+      part.deps.clear();
+    }
+    for (auto &it : data.deps) {
+      parts_[it.first % parts_.size()].deps[it.first] = std::move(it.second);
+    }
+    data.deps.clear();
+    for (size_t p = 0; p < parts_.size(); p++) {
+      stats_[p].Set(parts_[p].deps);
+    }
+  }
+
+  Data Release() override {
+    Data res;
+    for (auto &part : parts_) {
+      res.deps.insert(std::make_move_iterator(part.deps.begin()),
+                      std::make_move_iterator(part.deps.end()));
+      part.deps.clear();
+    }
+    for (auto &stats : stats_) {
+      stats.rows = 0;
+      stats.entries = 0;
+    }
+    return res;
+  }
+
+private:
+  struct Inbox {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<std::vector<PairUpdate>> batches;
+  };
+
+  std::vector<Data> parts_;
+  std::vector<MatrixStats> stats_;
+};
+
+std::unique_ptr<TrainMatrix> MakeTrainMatrix() {
+  switch (kTrainMode) {
+  case TrainMode::kRouted:
+    return std::unique_ptr<TrainMatrix>(new RoutedTrainMatrix(kWorkerThreads));
+  case TrainMode::kShared:
+    return std::unique_ptr<TrainMatrix>(new SharedTrainMatrix(kWorkerThreads));
+  case TrainMode::kLocal:
+    break;
+  }
+  return std::unique_ptr<TrainMatrix>(new LocalTrainMatrix());
+}
+
+/**
+ * Prints training throughput every kProgressEverySeconds from a side thread
+ * and, when kProgressJsonPath is set, appends the same sample there as one
+ * JSON object per line. It only reads counters, so training never waits
+ * for it.
+ */
+class ProgressReporter {
+public:
+  ProgressReporter(const TrainMatrix &matrix, const TrainProgress &progress,
+                   size_t total_users)
+      : matrix_(matrix), progress_(progress), total_users_(total_users) {
+    if (kProgressEverySeconds <= 0)
+      return;
+    if (!kProgressJsonPath.empty())
+      json_.open(kProgressJsonPath, std::ios::app);
+    thread_ = std::thread(&ProgressReporter::Run, this);
+  }
+
+  ~ProgressReporter() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopped_ = true;
+    }
+    cv_.notify_all();
+    if (thread_.joinable())
+      thread_.join();
+  }
+
+private:
+  void Run() {
+    const auto start = std::chrono::steady_clock::now();
+    auto last = start;
+    size_t last_users = 0;
+    size_t last_pairs = 0;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!cv_.wait_for(lock, std::chrono::seconds(kProgressEverySeconds),
+                         [this]() { return stopped_; })) {
+      const auto now = std::chrono::steady_clock::now();
+      const size_t users = progress_.users.load(std::memory_order_relaxed);
+      const size_t pairs = progress_.pairs.load(std::memory_order_relaxed);
+      const double interval =
+          std::chrono::duration<double>(now - last).count();
+      const double elapsed =
+          std::chrono::duration<double>(now - start).count();
+      const double users_per_sec = (users - last_users) / interval;
+      const double pairs_per_sec = (pairs - last_pairs) / interval;
+      const double eta = users ? (total_users_ - users) * elapsed / users : -1;
+      const size_t entries = matrix_.Size();
+      const size_t bytes = matrix_.Bytes();
+      const auto wall = std::chrono::system_clock::now();
+      LogLine() << "Progress: users " << users << "/" << total_users_ << " ("
+                << static_cast<size_t>(users_per_sec) << "/s), pairs " << pairs
+                << " (" << static_cast<size_t>(pairs_per_sec)
+                << "/s), entries " << entries << ", bytes ~" << bytes
+                << ", eta " << static_cast<long>(eta) << "s; " << wall;
+      if (json_.is_open()) {
+        json_ << "{\"time\":\"" << wall << "\", \"users\":" << users
+              << ", \"users_total\":" << total_users_
+              << ", \"users_per_sec\":" << users_per_sec
+              << ", \"pairs\":" << pairs
+              << ", \"pairs_per_sec\":" << pairs_per_sec
+              << ", \"entries\":" << entries << ", \"bytes\":" << bytes
+              << ", \"eta_sec\":" << eta << "}" << std::endl;
+      }
+      last = now;
+      last_users = users;
+      last_pairs = pairs;
+    }
+  }
+
+  const TrainMatrix &matrix_;
+  const TrainProgress &progress_;
+  const size_t total_users_;
+  std::ofstream json_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stopped_ = false;
+  std::thread thread_;
+};
+
+/**
+ * Writes checkpoints from a fork()ed child. The child sees a copy-on-write
+ * snapshot of the process as of the fork, so it can stream the matrix to
+ * disk while the parent keeps counting; only pages the parent modifies in
+ * the meantime get copied. At most one save is in flight: starting another
+ * one waits for the previous child first.
+ */
+class BackgroundCheckpointer {
+public:
+  ~BackgroundCheckpointer() { Wait(); }
+
+  // Returns false if no child could be forked; the caller then has to save
+  // synchronously.
+  bool Start(const std::function<void()> &save, IdT user_id) {
+    Wait();
+    const pid_t pid = fork();
+    if (pid < 0)
+      return false;
+    if (pid == 0) {
+      // Other threads are gone here, so no iostreams: they may have held
+      // the stream locks at fork time.
+      try {
+        save();
+      } catch (const std::exception &e) {
+        const std::string message = std::string(e.what()) + "\n";
+        if (write(STDERR_FILENO, message.data(), message.size()) < 0) {
+        }
+        _exit(1);
+      } catch (...) {
+        _exit(1);
+      }
+      _exit(0);
+    }
+    child_ = pid;
+    user_id_ = user_id;
+    return true;
+  }
+
+  // Reaps the child if it has already finished.
+  void Poll() { Reap(WNOHANG); }
+
+  void Wait() { Reap(0); }
+
+  // Whether a save failed since the last call.
+  bool TakeFailure() {
+    const bool failed = failed_;
+    failed_ = false;
+    return failed;
+  }
+
+private:
+  void Reap(int options) {
+    if (child_ <= 0)
+      return;
+    int status = 0;
+    const pid_t res = waitpid(child_, &status, options);
+    if (res == 0)
+      return;
+    child_ = 0;
+    if (res < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      failed_ = true;
+      LogLine() << "Background save of " << user_id_ << " failed at "
+                << std::chrono::system_clock::now();
+      return;
+    }
+    LogLine() << user_id_ << " Saved at " << std::chrono::system_clock::now();
+  }
+
+  pid_t child_ = 0;
+  IdT user_id_ = 0;
+  bool failed_ = false;
+};
+
+/**
+ * A trained model and the write of it as the final r_data_big, which runs
+ * in the background so the model can be indexed meanwhile.
+ */
+struct TrainedData {
+  std::shared_ptr<const Data> data;
+  std::future<void> saved;
 };
 
-size_t CalcSize(const SparseMatrix &matrix) {
-  size_t deps_c = 0;
-  for (const auto &it : matrix) {
-    deps_c += it.second.size();
+/**
+ * users[0] is user number start.next_user of the train inputs. With
+ * |resume| the matrix is restored from the r_data_big chain, whose meta
+ * |start| was read from; otherwise --train-from may pick the resume point
+ * by user id.
+ */
+TrainedData ConstructData(std::vector<User> &&users, int tread_id,
+                          IdT *start_from_opt, TrainPosition start,
+                          bool resume) {
+  LogLine() << "Thread " << tread_id << " spawned at "
+            << std::chrono::system_clock::now();
+  auto tracks_deps = MakeTrainMatrix();
+  size_t pos = 0;
+  uint64_t counted = start.counted;
+  // Dumps are numbered; a delta holds the rows dirtied since the previous
+  // dump, so any failed or missing dump forces the next one to be full.
+  const bool deltas = kCheckpointFormat != CheckpointFormat::kText &&
+                      kFullCheckpointEvery > 1;
+  uint64_t sequence = 0;
+  int since_full = 0;
+  bool need_full = true;
+  std::unordered_set<IdT> dirty;
+  if (resume) {
+    CheckpointMeta meta;
+    tracks_deps->Assign(LoadCheckpointChain("r_data_big", &meta));
+    sequence = meta.sequence;
+    need_full = sequence == 0;
+  } else if (start_from_opt) {
+    while (pos < users.size() && users[pos].id != *start_from_opt)
+      pos++;
+    if (pos < users.size()) {
+      CheckpointMeta meta;
+      tracks_deps->Assign(LoadCheckpointChain("r_data_big", &meta));
+      sequence = meta.sequence;
+      need_full = sequence == 0;
+      counted += pos;
+    }
   }
-  return deps_c;
-}
-
-int Reduce(SparseMatrix &matrix, int threshold) {
-  int removed = 0;
-  auto it = matrix.begin();
-  while (it != matrix.end()) {
-    auto jt = it->second.begin();
-    while (jt != it->second.end()) {
-      if (jt->second < threshold) {
-        removed++;
-        jt = it->second.erase(jt);
-      } else {
-        jt++;
+  TrainProgress progress;
+  ProgressReporter reporter(*tracks_deps, progress, users.size() - pos);
+  BackgroundCheckpointer checkpointer;
+  auto save = [&tracks_deps, &dirty](const CheckpointMeta &meta, bool full) {
+    const std::string name = full ? "r_data_big"
+                                  : DeltaCheckpointName("r_data_big",
+                                                        meta.sequence);
+    if (full)
+      RemoveLaterDeltaCheckpoints("r_data_big", meta.sequence);
+    tracks_deps->Save(name, meta, full ? nullptr : &dirty);
+    if (full)
+      RemoveDeltaCheckpoints("r_data_big", meta.sequence);
+  };
+  auto meta = [&start, &pos, &counted](uint64_t sequence) {
+    CheckpointMeta res = {sequence, start};
+    res.position.next_user = start.next_user + pos;
+    res.position.counted = counted;
+    return res;
+  };
+  // Users are counted in rounds that end on clean/dump boundaries, so a
+  // round is the unit of work handed to the matrix.
+  while (pos < users.size()) {
+    const size_t round_end = std::min<size_t>(
+        users.size(), pos + (kCleanEvery - counted % kCleanEvery));
+    tracks_deps->Count(users, pos, round_end, progress);
+    checkpointer.Poll();
+    if (deltas) {
+      for (size_t u = pos; u < round_end; u++) {
+        dirty.insert(users[u].tracks.begin(), users[u].tracks.end());
       }
     }
-    if (it->second.empty()) {
-      it = matrix.erase(it);
-    } else {
-      it++;
+    counted += round_end - pos;
+    pos = round_end;
+    const User &user = users[pos - 1];
+    if (counted % kCleanEvery == 0) {
+      LogLine() << "Start clean batch " << tread_id << "; "
+                << tracks_deps->Size() << "; "
+                << std::chrono::system_clock::now();
+      auto removed =
+          tracks_deps->Reduce(kSaveThreshold, deltas ? &dirty : nullptr);
+      LogLine() << "After clean " << tread_id << ": " << removed << "; "
+                << std::chrono::system_clock::now();
+    }
+    if (counted % kDumpEvery == 0) {
+      LogLine() << "Start save " << tread_id << "; " << tracks_deps->Size()
+                << "; " << std::chrono::system_clock::now();
+      checkpointer.Wait();
+      need_full |= checkpointer.TakeFailure();
+      const bool full =
+          !deltas || need_full || since_full + 1 >= kFullCheckpointEvery;
+      const CheckpointMeta dump = meta(++sequence);
+      auto dump_save = [&save, dump, full]() { save(dump, full); };
+      if (!kBackgroundCheckpoints ||
+          !checkpointer.Start(dump_save, user.id)) {
+        dump_save();
+        LogLine() << user.id << " Saved at "
+                  << std::chrono::system_clock::now();
+      }
+      dirty.clear();
+      since_full = full ? 0 : since_full + 1;
+      need_full = false;
     }
   }
-  return removed;
+  checkpointer.Wait();
+  tracks_deps->Reduce(kSaveThreshold, nullptr);
+  LogLine() << "Thread " << tread_id << " done at "
+            << std::chrono::system_clock::now();
+  LogLine() << "Save at " << std::chrono::system_clock::now();
+  const CheckpointMeta final_meta = meta(++sequence);
+  TrainedData res;
+  res.data = std::make_shared<const Data>(tracks_deps->Release());
+  const auto data = res.data;
+  res.saved = std::async(std::launch::async, [data, final_meta]() {
+    RemoveLaterDeltaCheckpoints("r_data_big", final_meta.sequence);
+    SaveCheckpoint({&data->deps}, "r_data_big", final_meta);
+    RemoveDeltaCheckpoints("r_data_big", final_meta.sequence);
+    LogLine() << "Saved at " << std::chrono::system_clock::now();
+  });
+  return res;
 }
 
 /**
- * Data format:
- * <tracks_cnt>
- * <track_id> <deps_cnt> <popularity>
- * <depended_track_id> <weight>
- * ...
- * <depended_track_id> <weight>
- * ...
+ * The binary files MergeCheckpointRows() reads in place of some checkpoint
+ * files. Binary files are validated once, by |threads| threads, and then
+ * mapped by each merging thread. Text rows come in hash order, so each
+ * text file is loaded and written as a sorted temporary binary run next to
+ * |output|, one file at a time: a single text input is in memory at once.
+ * The runs are removed with this object.
  */
-void Save(const Data &data, const std::string &filename) {
-  static const char kSep = ' ';
-  std::ofstream os(filename);
-  os << data.deps.size() << std::endl;
-  for (auto it = data.deps.begin(); it != data.deps.end(); it++) {
-    // Suppose, popularity is useless
-    os << it->first << kSep << it->second.size() << kSep << /*popularity=*/0
-       << std::endl;
-    for (const auto jt : it->second) {
-      os << jt.first << kSep << jt.second << std::endl;
+class MergeRuns {
+public:
+  MergeRuns(const std::vector<std::string> &files, const std::string &output,
+            int threads)
+      : files_(files), runs_(files.size()) {
+    try {
+      Prepare(output, threads);
+    } catch (...) {
+      RemoveRuns();
+      throw;
     }
   }
-  os.close();
-}
 
-/**
- * Data format: see Save()
- */
-Data Load(const std::string &filename) {
-  std::ifstream is(filename);
-  Data res;
-  int tracks_cnt;
-  is >> tracks_cnt;
-  for (int i = 0; i < tracks_cnt; i++) {
-    int id, deps_cnt, popularity;
-    is >> id >> deps_cnt >> popularity;
-    // Suppose, popularity is useless
-    // res.popularity[id] = popularity;
-    auto &track_deps = res.deps[id];
-    for (int j = 0; j < deps_cnt; j++) {
-      int dep_tr_id, weight;
-      is >> dep_tr_id >> weight;
-      if (dep_tr_id != id)
-        track_deps[dep_tr_id] = weight;
+  MergeRuns(const MergeRuns &) = delete;
+  MergeRuns &operator=(const MergeRuns &) = delete;
+
+  ~MergeRuns() { RemoveRuns(); }
+
+  const std::vector<std::string> &Files() const { return files_; }
+
+private:
+  void Prepare(const std::string &output, int threads) {
+    RunWorkers(threads, [this, threads](int thread) {
+      for (size_t i = thread; i < files_.size(); i += threads) {
+        if (IsBinaryCheckpoint(files_[i]) &&
+            BinaryCheckpointReader(files_[i]).Header().flags &
+                kCheckpointDelta)
+          throw std::runtime_error("Can't merge delta checkpoint " +
+                                   files_[i]);
+      }
+    });
+    for (size_t i = 0; i < files_.size(); i++) {
+      if (IsBinaryCheckpoint(files_[i]))
+        continue;
+      runs_[i] = output + ".run" + std::to_string(i);
+      const Data data = Load(files_[i]);
+      BinaryCheckpointWriter writer(runs_[i], CheckpointMeta(),
+                                    kCheckpointGroupVarint);
+      WriteSortedRows({&data.deps}, writer, 0, 1, nullptr);
+      writer.Finish();
+      files_[i] = runs_[i];
     }
   }
-  return res;
-}
 
-User ParseUser(const std::string &line) {
-  static const int kIdIdx = 11;
-  const auto id_e_p = line.find("u;");
-  User res{static_cast<IdT>(std::stoi(line.substr(kIdIdx, id_e_p - kIdIdx)))};
-  auto tr_s_p = id_e_p + 15;
-  auto tr_e_p = line.find(";", tr_s_p);
-  auto tracks_e_p = line.rfind("]");
-  while (tr_e_p < tracks_e_p) {
-    res.tracks.push_back(
-        static_cast<IdT>(std::stoi(line.substr(tr_s_p, tr_e_p - tr_s_p))));
-    tr_s_p = tr_e_p + 1;
-    tr_e_p = line.find(";", tr_s_p);
+  void RemoveRuns() {
+    for (const auto &run : runs_) {
+      if (!run.empty())
+        unlink(run.c_str());
+    }
   }
 
-  return res;
-}
+  std::vector<std::string> files_;
+  std::vector<std::string> runs_;
+};
 
-Data ConstructData(std::vector<User> &&users, int tread_id,
-                   IdT *start_from_opt) {
-  std::cout << "Thread " << tread_id << " spawned at "
-            << std::chrono::system_clock::now() << std::endl;
-  Data tracks_deps;
-  int cnt = 1;
-  bool start_found = !start_from_opt;
-  for (auto it = users.begin(); it < users.end(); it++) {
-    const User &user = *it;
-    if (!start_found) {
-      if (user.id == *start_from_opt) {
-        start_found = true;
-        tracks_deps = Load("r_data_big");
+/**
+ * k-way merge of binary checkpoint files |inputs|, see MergeRuns: calls
+ * fn(id, deps) for every track with id % shards == shard in increasing id
+ * order, with the weights summed over all inputs and the entries below
+ * |threshold| dropped. Only the current row of each input is held, so
+ * memory does not grow with the matrix; the files are merged straight
+ * from their mappings, and rows of other shards are skipped without being
+ * decoded.
+ */
+template <typename F>
+void MergeCheckpointRows(const std::vector<std::string> &inputs,
+                         int threshold, int shard, int shards, F fn) {
+  std::vector<std::unique_ptr<BinaryCheckpointReader>> readers;
+  std::vector<CheckpointRow> rows(inputs.size());
+  using Head = std::pair<IdT, size_t>;
+  std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+  for (size_t i = 0; i < inputs.size(); i++) {
+    readers.emplace_back(
+        new BinaryCheckpointReader(inputs[i], /*validate=*/false));
+    if (readers[i]->NextId(rows[i]))
+      heads.emplace(rows[i].id, i);
+  }
+  std::vector<std::pair<IdT, int>> entries;
+  std::vector<std::pair<IdT, int>> deps;
+  while (!heads.empty()) {
+    const IdT id = heads.top().first;
+    const bool in_shard = static_cast<int>(id % shards) == shard;
+    entries.clear();
+    while (!heads.empty() && heads.top().first == id) {
+      const size_t i = heads.top().second;
+      heads.pop();
+      if (in_shard) {
+        readers[i]->ReadDeps(rows[i]);
+        for (uint32_t j = 0; j < rows[i].size; j++) {
+          if (rows[i].ids[j] != id)
+            entries.emplace_back(rows[i].ids[j], rows[i].weights[j]);
+        }
       } else {
-        continue;
+        readers[i]->SkipDeps(rows[i]);
       }
+      if (!readers[i]->NextId(rows[i]))
+        continue;
+      if (rows[i].id <= id)
+        throw std::runtime_error("Rows out of order in " + inputs[i]);
+      heads.emplace(rows[i].id, i);
     }
-    for (int i = 0; i < static_cast<int>(user.tracks.size()); i++) {
-      auto upper_bound =
-          std::min(static_cast<int>(user.tracks.size()), i + kDepShift);
-      for (int j = i; j < upper_bound; j++) {
-        tracks_deps.deps[user.tracks[i]][user.tracks[j]] += kDepShift - (j - i);
-      }
-    }
-    if (cnt % kCleanEvery == 0) {
-      std::cout << "Start clean batch " << tread_id << "; "
-                << CalcSize(tracks_deps.deps) << "; "
-                << std::chrono::system_clock::now() << std::endl;
-      auto removed = Reduce(tracks_deps.deps, kSaveThreshold);
-      std::cout << "After clean " << tread_id << ": " << removed << "; "
-                << std::chrono::system_clock::now() << std::endl;
-    }
-    if (cnt % kDumpEvery == 0) {
-      std::cout << "Start save " << tread_id << "; "
-                << CalcSize(tracks_deps.deps) << "; "
-                << std::chrono::system_clock::now() << std::endl;
-      Save(tracks_deps, "r_data_big.tmp");
-      system("mv r_data_big.tmp r_data_big");
-      std::cout << user.id << " Saved at " << std::chrono::system_clock::now()
-                << std::endl;
-    }
-    cnt++;
-  }
-  Reduce(tracks_deps.deps, kSaveThreshold);
-  std::cout << "Thread " << tread_id << " done at "
-            << std::chrono::system_clock::now() << std::endl;
-  return tracks_deps;
-}
-
-void Merge(Data &data, const Data &new_data) {
-  auto &deps = data.deps;
-  for (auto it = new_data.deps.begin(); it != new_data.deps.end(); it++) {
-    auto &tr_deps = deps[it->first];
-    for (auto jt = it->second.begin(); jt != it->second.end(); jt++) {
-      auto old_it = tr_deps.find(jt->first);
-      // first, no new threshold
-      if (old_it != tr_deps.end()) {
-        old_it->second += jt->second;
-      } else {
-        tr_deps.insert(*jt);
+    if (!in_shard)
+      continue;
+    std::sort(entries.begin(), entries.end());
+    deps.clear();
+    for (size_t j = 0; j < entries.size();) {
+      const IdT dep = entries[j].first;
+      int weight = 0;
+      for (; j < entries.size() && entries[j].first == dep; j++) {
+        weight += entries[j].second;
       }
+      if (weight >= threshold)
+        deps.emplace_back(dep, weight);
     }
+    if (!deps.empty())
+      fn(id, deps);
   }
 }
 
-void MergeAndSave() {
-  Data res;
-  for (auto batch_id = 0; batch_id < kThreads; batch_id++) {
-    std::cout << "Start merge batch_id " << batch_id << " at "
-              << std::chrono::system_clock::now() << std::endl
-              << std::flush;
-    for (auto dump_id = 0; dump_id < 20; dump_id++) {
-      auto filename =
-          "r_data_" + std::to_string(batch_id) + "_" + std::to_string(dump_id);
-      Merge(res, Load(filename));
+/**
+ * Atomically writes the sum of checkpoints |inputs| as checkpoint
+ * |output| in kCheckpointFormat, see MergeCheckpointRows(). The rows are
+ * partitioned by id over max(kCheckpointShards, kWorkerThreads) threads,
+ * each merging its partition across all inputs. A binary output gets one
+ * shard per thread; text partitions are written to part files and joined.
+ */
+void MergeCheckpoints(const std::vector<std::string> &inputs,
+                      const std::string &output, int threshold) {
+  std::vector<std::string> files;
+  for (const auto &input : inputs) {
+    for (const auto &file : CheckpointFiles(input)) {
+      files.push_back(file);
+    }
+  }
+  const int threads = std::max(kCheckpointShards, kWorkerThreads);
+  const MergeRuns runs(files, output, threads);
+  const auto &merge_inputs = runs.Files();
+  if (kCheckpointFormat != CheckpointFormat::kText) {
+    WriteBinaryCheckpoint(
+        output, CheckpointMeta(), 0,
+        [&merge_inputs, threshold](BinaryCheckpointWriter &writer, int shard,
+                                   int shards) {
+          MergeCheckpointRows(
+              merge_inputs, threshold, shard, shards,
+              [&writer](IdT id, const std::vector<std::pair<IdT, int>> &deps) {
+                writer.AddRow(id, deps);
+              });
+        },
+        threads);
+    return;
+  }
+  // The text format starts with tracks_cnt, which is known only once all
+  // partitions are merged.
+  static const char kSep = ' ';
+  std::vector<size_t> tracks_cnts(threads);
+  RunWorkers(threads, [&](int thread) {
+    TextWriter os(output + ".part" + std::to_string(thread));
+    MergeCheckpointRows(
+        merge_inputs, threshold, thread, threads,
+        [&](IdT id, const std::vector<std::pair<IdT, int>> &deps) {
+          os << id << kSep << deps.size() << kSep << /*popularity=*/0 << '\n';
+          for (const auto &dep : deps) {
+            os << dep.first << kSep << dep.second << '\n';
+          }
+          tracks_cnts[thread]++;
+        });
+    os.Finish();
+  });
+  size_t tracks_cnt = 0;
+  for (const auto cnt : tracks_cnts) {
+    tracks_cnt += cnt;
+  }
+  TextWriter os(output + ".tmp");
+  os << tracks_cnt << '\n';
+  for (int thread = 0; thread < threads; thread++) {
+    const std::string part = output + ".part" + std::to_string(thread);
+    {
+      MappedFile file(part);
+      os.Write(file.data(), file.size());
+    }
+    unlink(part.c_str());
+  }
+  os.Finish();
+  ReplaceCheckpoint(output + ".tmp", output);
+}
+
+/**
+ * The checkpoints named by |spec|: "@<manifest>" lists one per line,
+ * anything else is a glob pattern such as "r_data_*_*". Globbing skips
+ * what is not a whole full checkpoint: shard files of matched manifests,
+ * deltas and unfinished .tmp files.
+ */
+std::vector<std::string> ExpandMergeInputs(const std::string &spec) {
+  std::vector<std::string> inputs;
+  if (!spec.empty() && spec[0] == '@') {
+    std::ifstream is(spec.substr(1));
+    if (!is)
+      throw std::runtime_error("Can't open " + spec.substr(1));
+    std::string line;
+    while (std::getline(is, line)) {
+      if (!line.empty())
+        inputs.push_back(line);
+    }
+    return inputs;
+  }
+  glob_t matches;
+  const int res = glob(spec.c_str(), 0, nullptr, &matches);
+  if (res == GLOB_NOMATCH)
+    return inputs;
+  if (res != 0)
+    throw std::runtime_error("Bad merge input pattern " + spec);
+  std::vector<std::string> paths(matches.gl_pathv,
+                                 matches.gl_pathv + matches.gl_pathc);
+  globfree(&matches);
+  std::unordered_set<std::string> parts;
+  for (const auto &path : paths) {
+    if (IsShardManifest(path)) {
+      const auto files = CheckpointFiles(path);
+      parts.insert(files.begin(), files.end());
     }
   }
-  Save(std::move(res), "r_merged_5kk");
+  static const std::string kTmp = ".tmp";
+  for (const auto &path : paths) {
+    const auto shard_path = DirName(path) + "/" +
+                            path.substr(path.find_last_of('/') + 1);
+    if (parts.count(shard_path) ||
+        (path.size() >= kTmp.size() &&
+         path.compare(path.size() - kTmp.size(), kTmp.size(), kTmp) == 0) ||
+        ReadCheckpointHeader(CheckpointFiles(path).front()).flags &
+            kCheckpointDelta)
+      continue;
+    inputs.push_back(path);
+  }
+  return inputs;
 }
 
-std::vector<User> ReadData(const std::string &filename, int reserve = 0) {
+void MergeAndSave(const std::string &spec, const std::string &output,
+                  int threshold) {
+  const auto inputs = ExpandMergeInputs(spec);
+  if (inputs.empty())
+    throw std::runtime_error("No checkpoints match " + spec);
+  LogLine() << "Start merge of " << inputs.size() << " checkpoints at "
+            << std::chrono::system_clock::now();
+  MergeCheckpoints(inputs, output, threshold);
+  LogLine() << "Merged at " << std::chrono::system_clock::now();
+}
+
+// The first |skip| lines are stepped over without being parsed; |lines|
+// receives the number of lines in the file. With |keep| set, only the
+// users whose id it accepts are parsed and returned.
+std::vector<User> ReadData(const std::string &filename, int reserve = 0,
+                           uint64_t skip = 0, uint64_t *lines = nullptr,
+                           const std::function<bool(IdT)> &keep = nullptr) {
   std::vector<User> users;
-  if (reserve)
+  if (reserve > 0)
     users.reserve(reserve);
   std::ifstream is(filename);
+  uint64_t skipped = 0;
+  while (skipped < skip && is.peek() != std::char_traits<char>::eof()) {
+    is.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    skipped++;
+  }
   std::string line;
+  uint64_t read = 0;
   while (std::getline(is, line)) {
-    users.push_back(ParseUser(line));
+    read++;
+    if (!keep || keep(ParseUserId(line)))
+      users.push_back(ParseUser(line));
   }
+  if (lines)
+    *lines = skipped + read;
   return users;
 }
 
-std::vector<User> ReadTrain() {
-  auto fut1 = std::async(std::launch::async, ReadData,
-                         std::string("data_train_5kk.yson"), 5000000);
-  auto fut2 = std::async(std::launch::async, ReadData,
-                         std::string("data_train_4kk.yson"), 4000000);
-  auto users1 = fut1.get();
-  auto users2 = fut2.get();
-  users1.insert(users1.end(), std::make_move_iterator(users2.begin()),
-                std::make_move_iterator(users2.end()));
-  users2.clear();
-  return users1;
-}
-
-Data TrainHard(IdT *start_from_opt) {
-  auto fut3 = std::async(std::launch::async, ReadData,
-                         std::string("data_test.yson"), 1105889);
-  auto train = ReadTrain();
-  auto test = fut3.get();
-  std::cout << "read tasks done at " << std::chrono::system_clock::now()
-            << std::endl;
-  train.insert(train.begin(), std::make_move_iterator(test.begin()),
-               std::make_move_iterator(test.end()));
-  test.clear();
-
-  auto train_fut = std::async(std::launch::async, ConstructData,
-                              std::move(train), 0, start_from_opt);
+const char *const kTrainFiles[kTrainInputs] = {
+    "data_test.yson", "data_train_5kk.yson", "data_train_4kk.yson"};
+const int kTrainReserve[kTrainInputs] = {1105889, 5000000, 4000000};
+
+/**
+ * Reads the train inputs, trains on them and returns the model along with
+ * its pending save as r_data_big. With |resume| the position stored in the
+ * r_data_big chain says how many users are already counted; they are
+ * skipped unparsed and training continues right after.
+ */
+TrainedData TrainHard(IdT *start_from_opt, bool resume) {
+  TrainPosition start = TrainPosition();
+  if (resume) {
+    start = ReadCheckpointChainMeta("r_data_big").position;
+    if (!start.next_user)
+      throw std::runtime_error("r_data_big has no train position to resume "
+                               "from, use --train-from");
+    LogLine() << "Resume from user " << start.next_user << ", counted "
+              << start.counted;
+  }
+  uint64_t skip_left = start.next_user;
+  uint64_t skips[kTrainInputs];
+  uint64_t lines[kTrainInputs] = {};
+  std::future<std::vector<User>> reads[kTrainInputs];
+  for (int k = 0; k < kTrainInputs; k++) {
+    skips[k] = std::min(skip_left, start.input_users[k]);
+    skip_left -= skips[k];
+    reads[k] = std::async(std::launch::async, [k, &skips, &lines]() {
+      return ReadData(kTrainFiles[k],
+                      kTrainReserve[k] - static_cast<int>(skips[k]), skips[k],
+                      &lines[k]);
+    });
+  }
+  std::vector<User> train;
+  for (int k = 0; k < kTrainInputs; k++) {
+    auto users = reads[k].get();
+    train.insert(train.end(), std::make_move_iterator(users.begin()),
+                 std::make_move_iterator(users.end()));
+  }
+  LogLine() << "read tasks done at " << std::chrono::system_clock::now();
+  for (int k = 0; k < kTrainInputs; k++) {
+    if (resume && lines[k] != start.input_users[k])
+      throw std::runtime_error(std::string(kTrainFiles[k]) +
+                               " changed since the checkpoint");
+    start.input_users[k] = lines[k];
+  }
+  if (skip_left)
+    throw std::runtime_error("Checkpoint position is past the train inputs");
+
+  auto train_fut =
+      std::async(std::launch::async, ConstructData, std::move(train), 0,
+                 start_from_opt, start, resume);
 
   while (train_fut.wait_for(std::chrono::seconds(0)) !=
          std::future_status::ready) {
     int thold;
-    std::cout << "Change thold:" << std::endl;
+    LogLine() << "Change thold:";
     std::cin >> thold;
     kSaveThreshold = thold;
   }
-  auto data = train_fut.get();
+  return train_fut.get();
+}
+
+std::string ShardDumpName(int batch, int dump) {
+  return "r_data_" + std::to_string(batch) + "_" + std::to_string(dump);
+}
+
+/**
+ * Counts the users with id % shards == shard, a subset that does not
+ * depend on the machine or the input order, into partial matrices
+ * r_data_<shard>_<dump> of kDumpEvery users each. The dumps hold raw
+ * counts of disjoint users, so their sum over all shards is the whole
+ * matrix: nothing is thresholded here, that is left to the merge. Dumps
+ * are committed atomically, so with |resume| those already written are
+ * skipped.
+ */
+void TrainShard(int shard, int shards, bool resume) {
+  // Users of other shards are dropped as they are read, before their
+  // tracks are parsed.
+  const auto in_shard = [shard, shards](IdT id) {
+    return static_cast<int>(id % shards) == shard;
+  };
+  std::future<std::vector<User>> reads[kTrainInputs];
+  for (int k = 0; k < kTrainInputs; k++) {
+    reads[k] = std::async(std::launch::async, [k, shards, &in_shard]() {
+      return ReadData(kTrainFiles[k], kTrainReserve[k] / shards, 0, nullptr,
+                      in_shard);
+    });
+  }
+  std::vector<User> train;
+  for (int k = 0; k < kTrainInputs; k++) {
+    auto users = reads[k].get();
+    train.insert(train.end(), std::make_move_iterator(users.begin()),
+                 std::make_move_iterator(users.end()));
+  }
+  LogLine() << "Shard " << shard << "/" << shards << ": " << train.size()
+            << " users at " << std::chrono::system_clock::now();
+  const int dumps = static_cast<int>((train.size() + kDumpEvery - 1) /
+                                     kDumpEvery);
+  // Dumps past the last one are left over from a run on other inputs.
+  for (int dump = dumps; RemoveCheckpoint(ShardDumpName(shard, dump));
+       dump++) {
+  }
+  auto matrix = MakeTrainMatrix();
+  TrainProgress progress;
+  ProgressReporter reporter(*matrix, progress, train.size());
+  for (int dump = 0; dump < dumps; dump++) {
+    const std::string name = ShardDumpName(shard, dump);
+    const size_t begin = static_cast<size_t>(dump) * kDumpEvery;
+    const size_t end = std::min(train.size(), begin + kDumpEvery);
+    if (resume && FileExists(name)) {
+      progress.Add(end - begin, 0);
+      continue;
+    }
+    matrix->Count(train, begin, end, progress);
+    matrix->Save(name, CheckpointMeta(), nullptr);
+    matrix->Release();
+    LogLine() << name << " saved at " << std::chrono::system_clock::now();
+  }
+}
+
+/**
+ * Runs TrainShard() for shards 0 .. |shards| - 1 as child processes of
+ * this binary with the same arguments, then merges their dumps into
+ * r_data_big with kSaveThreshold. Across machines sharing a filesystem,
+ * run --shard i/N on each and --merge once all are done instead.
+ */
+void TrainSharded(int shards, bool resume, int argc, char **argv) {
+  std::vector<pid_t> children;
+  for (int shard = 0; shard < shards; shard++) {
+    const std::string shard_arg =
+        std::to_string(shard) + "/" + std::to_string(shards);
+    std::vector<char *> args(argv, argv + argc);
+    args.push_back(const_cast<char *>("--shard"));
+    args.push_back(const_cast<char *>(shard_arg.c_str()));
+    args.push_back(nullptr);
+    const pid_t pid = fork();
+    if (pid < 0)
+      throw std::runtime_error("Can't fork shard " + shard_arg);
+    if (pid == 0) {
+      // Shards must not outlive a killed coordinator.
+      prctl(PR_SET_PDEATHSIG, SIGTERM);
+      execv("/proc/self/exe", args.data());
+      _exit(127);
+    }
+    children.push_back(pid);
+  }
+  int failed = 0;
+  for (const pid_t pid : children) {
+    int status = 0;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0)
+      failed++;
+  }
+  if (failed)
+    throw std::runtime_error(std::to_string(failed) + " of " +
+                             std::to_string(shards) + " shards failed" +
+                             (resume ? "" : ", rerun with --resume"));
+  std::vector<std::string> dumps;
+  for (int shard = 0; shard < shards; shard++) {
+    for (int dump = 0; FileExists(ShardDumpName(shard, dump)); dump++) {
+      dumps.push_back(ShardDumpName(shard, dump));
+    }
+  }
+  LogLine() << "Merge " << dumps.size() << " shard dumps at "
+            << std::chrono::system_clock::now();
+  MergeCheckpoints(dumps, "r_data_big", kSaveThreshold);
+  LogLine() << "Save at " << std::chrono::system_clock::now();
+}
+
+/**
+ * Prebuilt index file, little-endian:
+ * IndexHeader
+ * <track_id:u32> x rows                    (row_ids_at)
+ * <offset:u64> x (rows + 1)                (offsets_at)
+ * <track_id:u32> x entries                 (ids_at)
+ * <score:i32|u16|u8> x entries             (scores_at)
+ * <scale:f32> x rows, quantized only       (scales_at)
+ * dense lookup <slot:u32> x lookup_size, or
+ * hash lookup <track_id:u32> <slot:u32> x lookup_size  (lookup_at)
+ * Every section is 8-byte aligned, so DataIndex::Map() uses the file in
+ * place and processes predicting from the same file share its pages.
+ */
+const char kIndexMagic[4] = {'M', 'R', 'I', 'X'};
+const uint32_t kIndexVersion = 2;
+
+struct IndexHeader {
+  char magic[4];
+  uint32_t version;
+  uint64_t rows;
+  uint64_t entries;
+  uint64_t lookup_size;
+  uint32_t lookup_dense;
+  uint32_t lookup_shift;
+  uint32_t score_bits;
+  uint32_t reserved;
+  uint64_t row_ids_at;
+  uint64_t offsets_at;
+  uint64_t ids_at;
+  uint64_t scores_at;
+  uint64_t scales_at;
+  uint64_t lookup_at;
+  uint64_t file_size;
+};
+
+void CheckScoreBits(int score_bits) {
+  if (score_bits != 8 && score_bits != 16 && score_bits != 32)
+    throw std::runtime_error("Index scores are 8, 16 or 32 bits, not " +
+                             std::to_string(score_bits));
+}
+
+/**
+ * Neighbours of every track by decreasing score, in CSR form: packed ids
+ * and scores arrays, with the row in slot i at [offsets[i], offsets[i + 1]).
+ * Scores are exact i32, or u16 / u8 scaled so that the best score of the
+ * row takes the whole range; Row::score() dequantizes them. A track id
+ * maps to its slot through a dense table when ids are compact and through
+ * an open-addressing table otherwise, so a lookup touches one or two cache
+ * lines instead of a hash node and a separate vector. The arrays are
+ * either owned or a mapped index file, see Save() and Map().
+ */
+class DataIndex {
+public:
+  class Row {
+  public:
+    Row() = default;
+    Row(const IdT *ids, const char *scores, size_t size, int score_bits,
+        float scale)
+        : ids_(ids), scores_(scores), size_(size), score_bits_(score_bits),
+          scale_(scale) {}
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    IdT id(size_t i) const { return ids_[i]; }
+    int score(size_t i) const {
+      switch (score_bits_) {
+      case 8:
+        return Dequantize(reinterpret_cast<const uint8_t *>(scores_)[i]);
+      case 16:
+        return Dequantize(reinterpret_cast<const uint16_t *>(scores_)[i]);
+      default:
+        return reinterpret_cast<const int32_t *>(scores_)[i];
+      }
+    }
+
+  private:
+    int Dequantize(uint32_t value) const {
+      return static_cast<int>(value * scale_ + 0.5f);
+    }
+
+    const IdT *ids_ = nullptr;
+    const char *scores_ = nullptr;
+    size_t size_ = 0;
+    int score_bits_ = 32;
+    float scale_ = 1;
+  };
+
+  DataIndex() = default;
+  DataIndex(DataIndex &&) = default;
+  DataIndex &operator=(DataIndex &&) = default;
+  DataIndex(const DataIndex &) = delete;
+  DataIndex &operator=(const DataIndex &) = delete;
+
+  // Rough heap cost of an index, for load-time memory checks.
+  static uint64_t Bytes(uint64_t rows, uint64_t entries, int score_bits) {
+    return rows * (sizeof(IdT) + sizeof(uint64_t) + sizeof(float) +
+                   4 * sizeof(uint32_t)) +
+           entries * (sizeof(IdT) + score_bits / 8);
+  }
+
+  /**
+   * Lays out slot i for track row_ids[i] with sizes[i] entries of
+   * |score_bits| wide scores; the ids must be unique. The rows are then
+   * filled through SetRow().
+   */
+  void Reset(std::vector<IdT> &&row_ids, const std::vector<uint32_t> &sizes,
+             int score_bits) {
+    CheckScoreBits(score_bits);
+    file_.reset();
+    score_bits_ = score_bits;
+    own_row_ids_ = std::move(row_ids);
+    own_offsets_.assign(own_row_ids_.size() + 1, 0);
+    for (size_t i = 0; i < own_row_ids_.size(); i++) {
+      own_offsets_[i + 1] = own_offsets_[i] + sizes[i];
+    }
+    own_ids_.assign(own_offsets_.back(), 0);
+    own_scores_.assign((own_offsets_.back() * ScoreBytes() + 7) / 8, 0);
+    own_scales_.assign(score_bits_ < 32 ? own_row_ids_.size() : 0, 1.0f);
+    rows_ = own_row_ids_.size();
+    row_ids_ = own_row_ids_.data();
+    offsets_ = own_offsets_.data();
+    ids_ = own_ids_.data();
+    scores_ = reinterpret_cast<const char *>(own_scores_.data());
+    scales_ = score_bits_ < 32 ? own_scales_.data() : nullptr;
+    BuildLookup();
+  }
+
+  size_t Rows() const { return rows_; }
+  size_t Entries() const { return offsets_[rows_]; }
+  int ScoreBits() const { return score_bits_; }
+  IdT RowId(size_t slot) const { return row_ids_[slot]; }
+
+  /**
+   * Fills slot |slot| with [begin, end), which must hold as many entries
+   * as Reset() gave it. Distinct slots may be filled concurrently.
+   */
+  void SetRow(size_t slot, const ScoredTrackId *begin,
+              const ScoredTrackId *end) {
+    const uint64_t at = offsets_[slot];
+    for (auto it = begin; it != end; it++) {
+      own_ids_[at + (it - begin)] = it->track_id;
+    }
+    char *scores = reinterpret_cast<char *>(own_scores_.data());
+    switch (score_bits_) {
+    case 8:
+      own_scales_[slot] =
+          Quantize(begin, end, reinterpret_cast<uint8_t *>(scores) + at);
+      break;
+    case 16:
+      own_scales_[slot] =
+          Quantize(begin, end, reinterpret_cast<uint16_t *>(scores) + at);
+      break;
+    default:
+      for (auto it = begin; it != end; it++) {
+        reinterpret_cast<int32_t *>(scores)[at + (it - begin)] = it->score;
+      }
+    }
+  }
+
+  // Slot of track |id|, or Rows() if it has no row.
+  size_t Slot(IdT id) const {
+    if (lookup_dense_)
+      return id < lookup_size_ ? dense_[id] : Rows();
+    for (size_t i = Hash(id);; i = (i + 1) & (lookup_size_ - 1)) {
+      if (table_[i].slot == kNoSlot || table_[i].id == id)
+        return table_[i].slot == kNoSlot ? Rows() : table_[i].slot;
+    }
+  }
+
+  Row At(size_t slot) const {
+    const uint64_t at = offsets_[slot];
+    return Row(ids_ + at, scores_ + at * ScoreBytes(),
+               offsets_[slot + 1] - at, score_bits_,
+               scales_ ? scales_[slot] : 1.0f);
+  }
 
-  std::cout << "Save at " << std::chrono::system_clock::now() << std::endl;
-  Save(data, "r_data_big.tmp");
-  system("mv r_data_big.tmp r_data_big");
+  Row Find(IdT id) const {
+    const size_t slot = Slot(id);
+    if (slot == Rows())
+      return Row();
+    return At(slot);
+  }
+
+  // Atomically writes the index as an index file.
+  void Save(const std::string &filename) const {
+    IndexHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, kIndexMagic, sizeof(header.magic));
+    header.version = kIndexVersion;
+    header.rows = rows_;
+    header.entries = Entries();
+    header.lookup_size = lookup_size_;
+    header.lookup_dense = lookup_dense_;
+    header.lookup_shift = lookup_shift_;
+    header.score_bits = score_bits_;
+    uint64_t at = sizeof(header);
+    auto section = [&at](uint64_t bytes) {
+      const uint64_t res = (at + 7) / 8 * 8;
+      at = res + bytes;
+      return res;
+    };
+    const uint64_t scales_bytes = scales_ ? rows_ * sizeof(float) : 0;
+    header.row_ids_at = section(rows_ * sizeof(IdT));
+    header.offsets_at = section((rows_ + 1) * sizeof(uint64_t));
+    header.ids_at = section(Entries() * sizeof(IdT));
+    header.scores_at = section(Entries() * ScoreBytes());
+    header.scales_at = section(scales_bytes);
+    header.lookup_at = section(lookup_size_ * (lookup_dense_
+                                                   ? sizeof(uint32_t)
+                                                   : sizeof(LookupSlot)));
+    header.file_size = at;
+    const std::string tmp_filename = filename + ".tmp";
+    {
+      std::ofstream os(tmp_filename, std::ios::binary);
+      uint64_t pos = 0;
+      auto write = [&os, &pos](uint64_t at, const void *data, size_t bytes) {
+        static const char kPadding[8] = {};
+        os.write(kPadding, at - pos);
+        os.write(static_cast<const char *>(data), bytes);
+        pos = at + bytes;
+      };
+      write(0, &header, sizeof(header));
+      write(header.row_ids_at, row_ids_, rows_ * sizeof(IdT));
+      write(header.offsets_at, offsets_, (rows_ + 1) * sizeof(uint64_t));
+      write(header.ids_at, ids_, Entries() * sizeof(IdT));
+      write(header.scores_at, scores_, Entries() * ScoreBytes());
+      write(header.scales_at, scales_, scales_bytes);
+      write(header.lookup_at,
+            lookup_dense_ ? static_cast<const void *>(dense_) : table_,
+            header.file_size - header.lookup_at);
+      os.close();
+      if (!os)
+        throw std::runtime_error("Failed to write " + tmp_filename);
+    }
+    CommitCheckpoint(tmp_filename, filename);
+  }
+
+  // Uses index file |filename| in place.
+  static DataIndex Map(const std::string &filename) {
+    DataIndex res;
+    res.file_ = std::make_shared<MappedFile>(filename, MADV_RANDOM);
+    const char *data = res.file_->data();
+    IndexHeader header;
+    if (res.file_->size() < sizeof(header))
+      throw std::runtime_error("Truncated index " + filename);
+    std::memcpy(&header, data, sizeof(header));
+    if (std::memcmp(header.magic, kIndexMagic, sizeof(header.magic)) ||
+        header.version != kIndexVersion)
+      throw std::runtime_error("Bad index header in " + filename);
+    if (header.file_size != res.file_->size())
+      throw std::runtime_error("Truncated index " + filename);
+    CheckScoreBits(header.score_bits);
+    res.rows_ = header.rows;
+    res.score_bits_ = header.score_bits;
+    res.row_ids_ = reinterpret_cast<const IdT *>(data + header.row_ids_at);
+    res.offsets_ =
+        reinterpret_cast<const uint64_t *>(data + header.offsets_at);
+    res.ids_ = reinterpret_cast<const IdT *>(data + header.ids_at);
+    res.scores_ = data + header.scores_at;
+    res.scales_ = res.score_bits_ < 32 ? reinterpret_cast<const float *>(
+                                             data + header.scales_at)
+                                       : nullptr;
+    res.lookup_size_ = header.lookup_size;
+    res.lookup_dense_ = header.lookup_dense;
+    res.lookup_shift_ = header.lookup_shift;
+    res.dense_ = reinterpret_cast<const uint32_t *>(data + header.lookup_at);
+    res.table_ = reinterpret_cast<const LookupSlot *>(data + header.lookup_at);
+    return res;
+  }
+
+private:
+  static const uint32_t kNoSlot = std::numeric_limits<uint32_t>::max();
+
+  struct LookupSlot {
+    IdT id;
+    uint32_t slot;
+  };
+
+  size_t ScoreBytes() const { return score_bits_ / 8; }
+
+  /**
+   * Stores the scores of [begin, end) into |out| and returns the scale
+   * that maps them back. Rows whose best score fits Q keep scale 1 and
+   * stay exact.
+   */
+  template <typename Q>
+  static float Quantize(const ScoredTrackId *begin, const ScoredTrackId *end,
+                        Q *out) {
+    const float max_value = std::numeric_limits<Q>::max();
+    int max_score = 0;
+    for (auto it = begin; it != end; it++) {
+      max_score = std::max(max_score, it->score);
+    }
+    const float scale = max_score > max_value ? max_score / max_value : 1.0f;
+    for (auto it = begin; it != end; it++) {
+      const float value = std::max(0.0f, it->score / scale + 0.5f);
+      *out++ = static_cast<Q>(std::min(max_value, value));
+    }
+    return scale;
+  }
+
+  size_t Hash(IdT id) const {
+    return static_cast<size_t>((id * 0x9e3779b97f4a7c15ull) >> lookup_shift_);
+  }
+
+  void BuildLookup() {
+    own_dense_.clear();
+    own_table_.clear();
+    const IdT max_id = rows_ ? *std::max_element(row_ids_, row_ids_ + rows_)
+                             : 0;
+    // Dense costs 4 bytes per id up to the largest one; worth it while
+    // that stays within a few bytes per row.
+    lookup_dense_ = max_id / 4 <= rows_ + 1024;
+    if (lookup_dense_) {
+      own_dense_.assign(static_cast<size_t>(max_id) + 1,
+                        static_cast<uint32_t>(rows_));
+      for (size_t i = 0; i < rows_; i++) {
+        own_dense_[row_ids_[i]] = static_cast<uint32_t>(i);
+      }
+      lookup_size_ = own_dense_.size();
+      dense_ = own_dense_.data();
+      return;
+    }
+    int bits = 1;
+    while ((size_t(1) << bits) < 2 * rows_) {
+      bits++;
+    }
+    lookup_shift_ = 64 - bits;
+    lookup_size_ = size_t(1) << bits;
+    own_table_.assign(lookup_size_, LookupSlot{0, kNoSlot});
+    for (size_t i = 0; i < rows_; i++) {
+      size_t j = Hash(row_ids_[i]);
+      while (own_table_[j].slot != kNoSlot) {
+        j = (j + 1) & (lookup_size_ - 1);
+      }
+      own_table_[j] = LookupSlot{row_ids_[i], static_cast<uint32_t>(i)};
+    }
+    table_ = own_table_.data();
+  }
 
-  return data;
+  size_t rows_ = 0;
+  const IdT *row_ids_ = nullptr;
+  const uint64_t *offsets_ = kNoOffsets;
+  const IdT *ids_ = nullptr;
+  const char *scores_ = nullptr;
+  const float *scales_ = nullptr;
+  int score_bits_ = 32;
+  size_t lookup_size_ = 0;
+  uint32_t lookup_dense_ = 1;
+  uint32_t lookup_shift_ = 63;
+  const uint32_t *dense_ = nullptr;
+  const LookupSlot *table_ = nullptr;
+  // Storage behind the pointers: owned arrays or a mapped file.
+  std::vector<IdT> own_row_ids_;
+  std::vector<uint64_t> own_offsets_;
+  std::vector<IdT> own_ids_;
+  std::vector<uint64_t> own_scores_; // 8-byte words of packed scores
+  std::vector<float> own_scales_;
+  std::vector<uint32_t> own_dense_;
+  std::vector<LookupSlot> own_table_;
+  std::shared_ptr<MappedFile> file_;
+
+  static const uint64_t kNoOffsets[1];
+};
+const uint32_t DataIndex::kNoSlot;
+const uint64_t DataIndex::kNoOffsets[1] = {0};
+
+bool ByScore(const ScoredTrackId &lhs, const ScoredTrackId &rhs) {
+  return lhs.score > rhs.score;
 }
 
 std::vector<ScoredTrackId> Convert(std::unordered_map<IdT, int> &map) {
@@ -278,19 +3169,80 @@ std::vector<ScoredTrackId> Convert(std::unordered_map<IdT, int> &map) {
   for (const auto &jt : map) {
     vec.push_back({jt.first, jt.second});
   }
-  std::sort(vec.begin(), vec.end(),
-            [](const ScoredTrackId &lhs, const ScoredTrackId &rhs) {
-              return lhs.score > rhs.score;
-            });
+  std::sort(vec.begin(), vec.end(), ByScore);
   map.clear();
   return vec;
 }
 
-DataIndex BuildIndex(Data &&data) {
-  DataIndex result;
-  for (auto &it : data.deps) {
-    result[it.first] = Convert(it.second);
+// Entries an index row of |size| candidates keeps.
+uint32_t IndexRowSize(size_t size) {
+  return static_cast<uint32_t>(kIndexTopK ? std::min(size, kIndexTopK)
+                                          : size);
+}
+
+/**
+ * Moves the best IndexRowSize(end - begin) entries of [begin, end) to its
+ * front by decreasing score and returns their number. Longer rows get a
+ * partial selection first, so only the kept entries are sorted.
+ */
+size_t SelectIndexRow(ScoredTrackId *begin, ScoredTrackId *end) {
+  const size_t keep = IndexRowSize(end - begin);
+  if (keep < static_cast<size_t>(end - begin))
+    std::nth_element(begin, begin + keep, end, ByScore);
+  std::sort(begin, begin + keep, ByScore);
+  return keep;
+}
+
+/**
+ * Indexes |data| with kWorkerThreads threads. Slots are laid out up front,
+ * so each thread selects and sorts whole rows straight into their own
+ * slots; chunks of consecutive slots are balanced by entries and handed
+ * out through a WorkStealingQueue, since hub rows dwarf the rest. |data|
+ * is only read, so it can be saved meanwhile.
+ */
+DataIndex BuildIndex(const Data &data, int score_bits) {
+  static const size_t kChunkEntries = 1 << 16;
+  std::vector<IdT> row_ids;
+  std::vector<uint32_t> sizes;
+  std::vector<const std::unordered_map<IdT, int> *> rows;
+  row_ids.reserve(data.deps.size());
+  sizes.reserve(data.deps.size());
+  rows.reserve(data.deps.size());
+  std::vector<std::pair<size_t, size_t>> chunks;
+  size_t chunk_entries = 0;
+  for (const auto &it : data.deps) {
+    if (chunk_entries >= kChunkEntries) {
+      chunks.emplace_back(chunks.empty() ? 0 : chunks.back().second,
+                          rows.size());
+      chunk_entries = 0;
+    }
+    row_ids.push_back(it.first);
+    // A track's pair with itself is counted but never predicted.
+    sizes.push_back(IndexRowSize(it.second.size() - it.second.count(it.first)));
+    rows.push_back(&it.second);
+    chunk_entries += it.second.size();
   }
+  chunks.emplace_back(chunks.empty() ? 0 : chunks.back().second, rows.size());
+  DataIndex result;
+  result.Reset(std::move(row_ids), sizes, score_bits);
+  WorkStealingQueue<std::pair<size_t, size_t>> queue(std::move(chunks),
+                                                     kWorkerThreads);
+  RunWorkers(kWorkerThreads, [&](int self) {
+    std::pair<size_t, size_t> chunk;
+    std::vector<ScoredTrackId> row;
+    while (queue.Pop(self, chunk)) {
+      for (size_t slot = chunk.first; slot < chunk.second; slot++) {
+        row.clear();
+        for (const auto &jt : *rows[slot]) {
+          if (jt.first != result.RowId(slot))
+            row.push_back({jt.first, jt.second});
+        }
+        const size_t keep =
+            SelectIndexRow(row.data(), row.data() + row.size());
+        result.SetRow(slot, row.data(), row.data() + keep);
+      }
+    }
+  });
   return result;
 }
 
@@ -303,13 +3255,13 @@ Prediction Predict(const DataIndex &data1, const User &user, int &trivials) {
   }
   std::unordered_set<IdT> seen(user.tracks.begin(), user.tracks.end());
   for (const auto &track_id : user.tracks) {
-    auto it = data1.find(track_id);
-    if (it != data1.end()) {
+    const auto row = data1.Find(track_id);
+    if (!row.empty()) {
       int cnt = 0;
-      for (auto scored : it->second) {
-        if (seen.count(scored.track_id))
+      for (size_t i = 0; i < row.size(); i++) {
+        if (seen.count(row.id(i)))
           continue;
-        pretendents[scored.track_id] += scored.score;
+        pretendents[row.id(i)] += row.score(i);
         if (cnt++ >= kDepShift) {
           break;
         }
@@ -335,17 +3287,137 @@ Prediction Predict(const DataIndex &data1, const User &user, int &trivials) {
   return result;
 }
 
-DataIndex LoadIndex(const std::string &filename) {
-  return BuildIndex(Load(filename));
+/**
+ * Indexes checkpoint |files| of |filename| with disjoint rows, such as
+ * its shards, straight from their rows: open(file, first_pass) returns a
+ * reader with Next(CheckpointRow &), Tell() and Seek(). The rows are read
+ * twice, so nothing but the index itself is held in memory. The first
+ * pass, one thread per file, sizes the CSR slots and notes where chunks
+ * of rows start; the memory check then uses the exact index size, which
+ * text checkpoints have no header for and top-K makes far smaller than
+ * the checkpoint. The chunks are then handed to kWorkerThreads threads
+ * through a WorkStealingQueue; each seeks its own reader to a chunk and
+ * selects and sorts its rows straight into their slots.
+ */
+template <typename Open>
+DataIndex StreamIndex(const std::string &filename,
+                      const std::vector<std::string> &files, int score_bits,
+                      Open open) {
+  static const size_t kChunkEntries = 1 << 16;
+  // |rows| rows of files[file] from |start| on, for slots from |slot|.
+  struct Chunk {
+    size_t file;
+    CheckpointPosition start;
+    size_t slot;
+    size_t rows;
+  };
+  const int threads = static_cast<int>(files.size());
+  std::vector<std::vector<IdT>> file_ids(files.size());
+  std::vector<std::vector<uint32_t>> file_sizes(files.size());
+  std::vector<std::vector<Chunk>> file_chunks(files.size());
+  RunWorkers(threads, [&](int f) {
+    auto reader = open(files[f], /*first_pass=*/true);
+    CheckpointRow row;
+    size_t chunk_entries = kChunkEntries;
+    for (auto start = reader->Tell(); reader->Next(row);
+         start = reader->Tell()) {
+      if (chunk_entries >= kChunkEntries) {
+        file_chunks[f].push_back(
+            {static_cast<size_t>(f), start, file_ids[f].size(), 0});
+        chunk_entries = 0;
+      }
+      file_chunks[f].back().rows++;
+      chunk_entries += row.size;
+      // A track's pair with itself is counted but never predicted.
+      size_t size = 0;
+      for (uint32_t j = 0; j < row.size; j++) {
+        size += row.ids[j] != row.id;
+      }
+      file_ids[f].push_back(row.id);
+      file_sizes[f].push_back(IndexRowSize(size));
+    }
+  });
+  std::vector<IdT> row_ids;
+  std::vector<uint32_t> sizes;
+  std::vector<Chunk> chunks;
+  for (size_t f = 0; f < files.size(); f++) {
+    for (auto chunk : file_chunks[f]) {
+      chunk.slot += row_ids.size();
+      chunks.push_back(chunk);
+    }
+    row_ids.insert(row_ids.end(), file_ids[f].begin(), file_ids[f].end());
+    sizes.insert(sizes.end(), file_sizes[f].begin(), file_sizes[f].end());
+    file_ids[f].clear();
+  }
+  uint64_t entries = 0;
+  for (const auto size : sizes) {
+    entries += size;
+  }
+  CheckMemory(DataIndex::Bytes(row_ids.size(), entries, score_bits),
+              filename);
+  DataIndex result;
+  result.Reset(std::move(row_ids), sizes, score_bits);
+  WorkStealingQueue<Chunk> queue(std::move(chunks), kWorkerThreads);
+  RunWorkers(kWorkerThreads, [&](int self) {
+    std::vector<decltype(open(files.front(), false))> readers(files.size());
+    Chunk chunk;
+    CheckpointRow row;
+    std::vector<ScoredTrackId> entries;
+    while (queue.Pop(self, chunk)) {
+      auto &reader = readers[chunk.file];
+      if (!reader)
+        reader = open(files[chunk.file], /*first_pass=*/false);
+      reader->Seek(chunk.start);
+      for (size_t slot = chunk.slot; slot < chunk.slot + chunk.rows; slot++) {
+        if (!reader->Next(row))
+          throw std::runtime_error("Checkpoint changed while indexing " +
+                                   files[chunk.file]);
+        entries.clear();
+        for (uint32_t j = 0; j < row.size; j++) {
+          if (row.ids[j] != row.id)
+            entries.push_back({row.ids[j], row.weights[j]});
+        }
+        const size_t keep =
+            SelectIndexRow(entries.data(), entries.data() + entries.size());
+        result.SetRow(slot, entries.data(), entries.data() + keep);
+      }
+    }
+  });
+  return result;
+}
+
+DataIndex LoadIndex(const std::string &filename, int score_bits) {
+  if (ReadCheckpointChainMeta(filename).sequence !=
+      ReadCheckpointMeta(filename).sequence) {
+    // An interrupted run left deltas newer than the base; they replace
+    // whole rows, so the chain is replayed into a matrix first.
+    LogLine() << "Replaying delta checkpoints of " << filename;
+    CheckpointMeta meta;
+    return BuildIndex(LoadCheckpointChain(filename, &meta), score_bits);
+  }
+  const auto files = CheckpointFiles(filename);
+  if (files.size() == 1 && !IsBinaryCheckpoint(filename)) {
+    return StreamIndex(filename, files, score_bits,
+                       [](const std::string &file, bool) {
+                         return std::unique_ptr<TextCheckpointReader>(
+                             new TextCheckpointReader(file));
+                       });
+  }
+  return StreamIndex(
+      filename, files, score_bits,
+      [](const std::string &file, bool first_pass) {
+        // The second pass skips the checksums the first one verified.
+        return std::unique_ptr<BinaryCheckpointReader>(
+            new BinaryCheckpointReader(file, first_pass));
+      });
 }
 
 void SavePredictions(std::vector<Prediction> &&predictions,
                      const std::string &filename) {
-  std::ofstream os(filename);
+  TextWriter os(filename);
   for (const auto &user : predictions) {
     os << "{\"user_id\":" << user.user_id << ", \"prediction\":\"";
     if (user.prediction.empty()) {
-      os.close();
       throw std::runtime_error("!!! Empty predictions for " +
                                std::to_string(user.user_id));
     }
@@ -355,48 +3427,273 @@ void SavePredictions(std::vector<Prediction> &&predictions,
     for (; it != user.prediction.end(); it++) {
       os << "\\t" << *it;
     }
-    os << "\"}" << std::endl;
+    os << "\"}" << '\n';
   }
-  os.close();
+  os.Finish();
 }
 
-int PredictAll() {
-  std::cout << "started at " << std::chrono::system_clock::now() << std::endl;
-  auto index1 = LoadIndex("r_data_big");
-  std::cout << "Index loaded " << std::chrono::system_clock::now() << std::endl;
+int PredictAll(const DataIndex &index1) {
   auto users = ReadData("data_test.yson");
-  std::cout << "Finish read data at " << std::chrono::system_clock::now()
-            << std::endl;
-  int cnt = 0;
-  std::vector<Prediction> predictions;
-  predictions.reserve(users.size());
-  int trivials = 0;
-  for (const auto &user : users) {
-    predictions.push_back(Predict(index1, user, trivials));
-    if (++cnt % 1000 == 0) {
-      std::cout << "user " << cnt << ", trivials: " << trivials << "; at "
-                << std::chrono::system_clock::now() << std::endl;
-    }
-  }
-  std::cout << "All predicted, sz = " << predictions.size()
-            << ", trivials: " << trivials << "at "
-            << std::chrono::system_clock::now() << std::endl;
+  LogLine() << "Finish read data at " << std::chrono::system_clock::now();
+  static const size_t kPredictChunk = 256;
+  std::vector<std::pair<size_t, size_t>> chunks;
+  for (size_t from = 0; from < users.size(); from += kPredictChunk) {
+    chunks.emplace_back(from, std::min(users.size(), from + kPredictChunk));
+  }
+  WorkStealingQueue<std::pair<size_t, size_t>> queue(std::move(chunks),
+                                                     kWorkerThreads);
+  std::vector<Prediction> predictions(users.size());
+  std::atomic<int> cnt{0};
+  std::atomic<int> trivials{0};
+  RunWorkers(kWorkerThreads, [&](int self) {
+    std::pair<size_t, size_t> chunk;
+    while (queue.Pop(self, chunk)) {
+      for (size_t u = chunk.first; u < chunk.second; u++) {
+        int user_trivials = 0;
+        predictions[u] = Predict(index1, users[u], user_trivials);
+        trivials += user_trivials;
+        const int done = ++cnt;
+        if (done % 1000 == 0) {
+          LogLine() << "user " << done << ", trivials: " << trivials
+                    << "; at " << std::chrono::system_clock::now();
+        }
+      }
+    }
+  });
+  LogLine() << "All predicted, sz = " << predictions.size()
+            << ", trivials: " << trivials.load() << "at "
+            << std::chrono::system_clock::now();
   SavePredictions(std::move(predictions), "predicted.json");
-  std::cout << "finished at " << std::chrono::system_clock::now() << std::endl;
+  LogLine() << "finished at " << std::chrono::system_clock::now();
+  return 0;
+}
+
+int PredictAll() {
+  LogLine() << "started at " << std::chrono::system_clock::now();
+  auto index1 = kIndexPath.empty()
+                    ? LoadIndex("r_data_big", kIndexScoreBits)
+                    : DataIndex::Map(kIndexPath);
+  LogLine() << "Index loaded " << std::chrono::system_clock::now();
+  return PredictAll(index1);
+}
+
+// Copy of |index| with |score_bits| wide scores.
+DataIndex QuantizeIndex(const DataIndex &index, int score_bits) {
+  std::vector<IdT> row_ids(index.Rows());
+  std::vector<uint32_t> sizes(index.Rows());
+  for (size_t slot = 0; slot < index.Rows(); slot++) {
+    row_ids[slot] = index.RowId(slot);
+    sizes[slot] = static_cast<uint32_t>(index.At(slot).size());
+  }
+  DataIndex result;
+  result.Reset(std::move(row_ids), sizes, score_bits);
+  std::vector<ScoredTrackId> row;
+  for (size_t slot = 0; slot < index.Rows(); slot++) {
+    const auto from = index.At(slot);
+    row.clear();
+    for (size_t i = 0; i < from.size(); i++) {
+      row.push_back({from.id(i), from.score(i)});
+    }
+    result.SetRow(slot, row.data(), row.data() + row.size());
+  }
+  return result;
+}
+
+// Share of the first |k| ids of |expected| found among those of |actual|.
+double TopOverlap(const std::vector<IdT> &expected,
+                  const std::vector<IdT> &actual, size_t k) {
+  const size_t n = std::min(k, expected.size());
+  if (n == 0)
+    return 1;
+  std::unordered_set<IdT> top(expected.begin(), expected.begin() + n);
+  size_t found = 0;
+  for (size_t i = 0; i < std::min(k, actual.size()); i++) {
+    found += top.count(actual[i]);
+  }
+  return static_cast<double>(found) / n;
+}
+
+/**
+ * Predicts the test users with the exact index and with its 16- and 8-bit
+ * quantizations, and reports for each precision the index size, the share
+ * of users whose list is unchanged and the mean top-10 and top-100
+ * overlap with the exact lists.
+ */
+int ReportIndexScoreBits() {
+  LogLine() << "started at " << std::chrono::system_clock::now();
+  auto exact = kIndexPath.empty() ? LoadIndex("r_data_big", 32)
+                                  : DataIndex::Map(kIndexPath);
+  if (exact.ScoreBits() != 32)
+    throw std::runtime_error("Score report needs an exact index");
+  const auto users = ReadData("data_test.yson");
+  auto predict_all = [&users](const DataIndex &index) {
+    std::vector<Prediction> predictions(users.size());
+    RunWorkers(kWorkerThreads, [&](int self) {
+      for (size_t u = self; u < users.size(); u += kWorkerThreads) {
+        int trivials = 0;
+        predictions[u] = Predict(index, users[u], trivials);
+      }
+    });
+    return predictions;
+  };
+  const auto expected = predict_all(exact);
+  LogLine() << "bits\tindex_mb\tsame_lists\ttop10\ttop100";
+  auto report = [&](const DataIndex &index,
+                    const std::vector<Prediction> &actual) {
+    size_t same = 0;
+    double top10 = 0;
+    double top100 = 0;
+    for (size_t u = 0; u < users.size(); u++) {
+      same += actual[u].prediction == expected[u].prediction;
+      top10 += TopOverlap(expected[u].prediction, actual[u].prediction, 10);
+      top100 +=
+          TopOverlap(expected[u].prediction, actual[u].prediction, 100);
+    }
+    const double n = std::max<size_t>(1, users.size());
+    const double mb = DataIndex::Bytes(index.Rows(), index.Entries(),
+                                       index.ScoreBits()) /
+                      double(1 << 20);
+    LogLine() << index.ScoreBits() << '\t' << mb << '\t' << same / n << '\t'
+              << top10 / n << '\t' << top100 / n;
+  };
+  report(exact, expected);
+  for (int score_bits : {16, 8}) {
+    const auto quantized = QuantizeIndex(exact, score_bits);
+    report(quantized, predict_all(quantized));
+  }
+  LogLine() << "finished at " << std::chrono::system_clock::now();
   return 0;
 }
 
 int main(int argc, char **argv) {
   IdT start_from;
   IdT *start_from_opt = nullptr;
-  if (argc > 1) {
-    if (std::string{"--train-from"} == argv[1]) {
-      start_from = static_cast<IdT>(std::stoi(argv[2]));
+  bool predict_only = false;
+  bool report_score_bits = false;
+  bool resume = false;
+  std::string export_from, export_to;
+  std::string merge_spec, merge_to;
+  std::string index_from, index_to;
+  int merge_threshold = 0;
+  int shard = -1;
+  int shards = 0;
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if (arg == "--train-from" && i + 1 < argc) {
+      start_from = static_cast<IdT>(std::stoi(argv[++i]));
       start_from_opt = &start_from;
-    } else if (std::string{"--predict"} == argv[1]) {
-      return PredictAll();
+    } else if (arg == "--resume") {
+      resume = true;
+    } else if (arg == "--predict") {
+      predict_only = true;
+    } else if (arg == "--train-mode" && i + 1 < argc) {
+      const std::string mode = argv[++i];
+      if (mode == "local") {
+        kTrainMode = TrainMode::kLocal;
+      } else if (mode == "shared") {
+        kTrainMode = TrainMode::kShared;
+      } else if (mode == "routed") {
+        kTrainMode = TrainMode::kRouted;
+      } else {
+        throw std::runtime_error("Unknown train mode " + mode);
+      }
+    } else if (arg == "--threads" && i + 1 < argc) {
+      kWorkerThreads = std::max(1, std::stoi(argv[++i]));
+    } else if (arg == "--checkpoint-format" && i + 1 < argc) {
+      const std::string format = argv[++i];
+      if (format == "text") {
+        kCheckpointFormat = CheckpointFormat::kText;
+      } else if (format == "binary") {
+        kCheckpointFormat = CheckpointFormat::kBinary;
+      } else if (format == "packed") {
+        kCheckpointFormat = CheckpointFormat::kPacked;
+      } else {
+        throw std::runtime_error("Unknown checkpoint format " + format);
+      }
+    } else if (arg == "--full-checkpoint-every" && i + 1 < argc) {
+      kFullCheckpointEvery = std::max(1, std::stoi(argv[++i]));
+    } else if (arg == "--ignore-memory-check") {
+      kCheckMemory = false;
+    } else if (arg == "--checkpoint-shards" && i + 1 < argc) {
+      kCheckpointShards = std::max(1, std::stoi(argv[++i]));
+    } else if (arg == "--sync-checkpoints") {
+      kBackgroundCheckpoints = false;
+    } else if (arg == "--export-text" && i + 2 < argc) {
+      export_from = argv[++i];
+      export_to = argv[++i];
+    } else if (arg == "--shard" && i + 1 < argc) {
+      const std::string spec = argv[++i];
+      const auto slash = spec.find('/');
+      if (slash == std::string::npos)
+        throw std::runtime_error("--shard wants i/N, got " + spec);
+      shard = std::stoi(spec.substr(0, slash));
+      shards = std::stoi(spec.substr(slash + 1));
+      if (shard < 0 || shard >= shards)
+        throw std::runtime_error("Bad shard " + spec);
+    } else if (arg == "--train-shards" && i + 1 < argc) {
+      shards = std::max(1, std::stoi(argv[++i]));
+    } else if (arg == "--build-index" && i + 2 < argc) {
+      index_from = argv[++i];
+      index_to = argv[++i];
+    } else if (arg == "--index" && i + 1 < argc) {
+      kIndexPath = argv[++i];
+    } else if (arg == "--index-score-bits" && i + 1 < argc) {
+      kIndexScoreBits = std::stoi(argv[++i]);
+      CheckScoreBits(kIndexScoreBits);
+    } else if (arg == "--report-index-score-bits") {
+      report_score_bits = true;
+    } else if (arg == "--index-top-k" && i + 1 < argc) {
+      kIndexTopK = static_cast<size_t>(std::max(0, std::stoi(argv[++i])));
+    } else if (arg == "--merge" && i + 2 < argc) {
+      merge_spec = argv[++i];
+      merge_to = argv[++i];
+    } else if (arg == "--merge-threshold" && i + 1 < argc) {
+      merge_threshold = std::stoi(argv[++i]);
+    } else if (arg == "--progress-every" && i + 1 < argc) {
+      kProgressEverySeconds = std::stoi(argv[++i]);
+    } else if (arg == "--progress-json" && i + 1 < argc) {
+      kProgressJsonPath = argv[++i];
     }
   }
-  TrainHard(start_from_opt);
-  return PredictAll();
+  if (!index_from.empty()) {
+    LoadIndex(index_from, kIndexScoreBits).Save(index_to);
+    return 0;
+  }
+  if (report_score_bits)
+    return ReportIndexScoreBits();
+  if (!merge_spec.empty()) {
+    MergeAndSave(merge_spec, merge_to, merge_threshold);
+    return 0;
+  }
+  if (!export_from.empty()) {
+    CheckpointMeta meta;
+    Save(LoadCheckpointChain(export_from, &meta), export_to);
+    return 0;
+  }
+  if (predict_only)
+    return PredictAll();
+  if (shard >= 0) {
+    TrainShard(shard, shards, resume);
+    return 0;
+  }
+  if (shards) {
+    TrainSharded(shards, resume, argc, argv);
+    // As below, an --index file is rebuilt from the merged r_data_big.
+    const auto index = LoadIndex("r_data_big", kIndexScoreBits);
+    if (!kIndexPath.empty())
+      index.Save(kIndexPath);
+    LogLine() << "Index built " << std::chrono::system_clock::now();
+    return PredictAll(index);
+  }
+  auto trained = TrainHard(start_from_opt, resume);
+  // Predict from the model in memory while r_data_big is being written;
+  // an --index file is rebuilt from it rather than used stale.
+  const auto index = BuildIndex(*trained.data, kIndexScoreBits);
+  trained.data.reset();
+  if (!kIndexPath.empty())
+    index.Save(kIndexPath);
+  LogLine() << "Index built " << std::chrono::system_clock::now();
+  const int res = PredictAll(index);
+  trained.saved.get();
+  return res;
 }